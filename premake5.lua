@@ -72,4 +72,5 @@ project "test.camera"
   includedirs { "../roselib/include" }
   includedirs { "../premake-comppp/include" }
   files { "test/**" }
+  removefiles { "test/out/**" }
 
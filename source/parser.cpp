@@ -1,18 +1,48 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
 #include <stdarg.h>
 #include <stdio.h>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "parser.h"
 
 #include <rose/hash.h>
-#include <rose/unused.h>
-#include <rose/streambuffer.h>
 #include <serializer/serializer.h>
 #include <serializer/jsonserializer.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX //std::min and std::max instead of the macros
+#endif
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define IMPL_SERIALIZER
 #include "parser_serializer.h"
@@ -30,146 +60,2140 @@ inline bool is_equal(const char * a, const char * b) {
   }
 }
 
-bool is_valid_operator(const char * op) {
-  //https://www.ibm.com/docs/en/zos/2.1.0?topic=only-overloading-operators
-  switch (rose::hash(op)) {
-  case rose::hash("operator!"):
-  case rose::hash("operator!="):
-  case rose::hash("operator%"):
-  case rose::hash("operator%="):
-  case rose::hash("operator&"):
-  case rose::hash("operator&&"):
-  case rose::hash("operator&="):
-  case rose::hash("operator*"):
-  case rose::hash("operator*="):
-  case rose::hash("operator+"):
-  case rose::hash("operator++"):
-  case rose::hash("operator+="):
-  case rose::hash("operator,"):
-  case rose::hash("operator-"):
-  case rose::hash("operator--"):
-  case rose::hash("operator-="):
-  case rose::hash("operator->"):
-  case rose::hash("operator->*"):
-  case rose::hash("operator<"):
-  case rose::hash("operator<<"):
-  case rose::hash("operator<<="):
-  case rose::hash("operator<="):
-  case rose::hash("operator="):
-  case rose::hash("operator=="):
-  case rose::hash("operator>"):
-  case rose::hash("operator>="):
-  case rose::hash("operator>>"):
-  case rose::hash("operator>>="):
-  case rose::hash("operator|"):
-  case rose::hash("operator|="):
-  case rose::hash("operator||"):
-  case rose::hash("operator~"):
-  case rose::hash("operator/"):
-  case rose::hash("operator/="):
-    return true;
-  default:
-    return false;
+bool is_valid_operator(const char * op) {
+  //https://www.ibm.com/docs/en/zos/2.1.0?topic=only-overloading-operators
+  switch (rose::hash(op)) {
+  case rose::hash("operator!"):
+  case rose::hash("operator!="):
+  case rose::hash("operator%"):
+  case rose::hash("operator%="):
+  case rose::hash("operator&"):
+  case rose::hash("operator&&"):
+  case rose::hash("operator&="):
+  case rose::hash("operator*"):
+  case rose::hash("operator*="):
+  case rose::hash("operator+"):
+  case rose::hash("operator++"):
+  case rose::hash("operator+="):
+  case rose::hash("operator,"):
+  case rose::hash("operator-"):
+  case rose::hash("operator--"):
+  case rose::hash("operator-="):
+  case rose::hash("operator->"):
+  case rose::hash("operator->*"):
+  case rose::hash("operator<"):
+  case rose::hash("operator<<"):
+  case rose::hash("operator<<="):
+  case rose::hash("operator<="):
+  case rose::hash("operator="):
+  case rose::hash("operator=="):
+  case rose::hash("operator>"):
+  case rose::hash("operator>="):
+  case rose::hash("operator>>"):
+  case rose::hash("operator>>="):
+  case rose::hash("operator|"):
+  case rose::hash("operator|="):
+  case rose::hash("operator||"):
+  case rose::hash("operator~"):
+  case rose::hash("operator/"):
+  case rose::hash("operator/="):
+    return true;
+  default:
+    return false;
+  }
+}
+
+template<size_t N>
+void copy(char(&dst)[N], const char * src) {
+  for (size_t i = 0; i != N; ++i) {
+    dst[i] = src[i];
+    if (dst[i] == 0) break;
+  }
+}
+
+//Copies the slice [begin, end) into dst, truncated to fit.
+template<size_t N>
+void copy(char(&dst)[N], const char * begin, const char * end) {
+  size_t len = (size_t)(end - begin);
+  if (len > N - 1) len = N - 1;
+  std::memcpy(dst, begin, len);
+  dst[len] = 0;
+}
+
+inline bool is_whitespace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+inline const char * skip_whitespace(const char * p, const char * end) {
+  while (p != end && is_whitespace(*p)) ++p;
+  return p;
+}
+
+inline const char * find_whitespace_or(const char * p, const char * end, char a, char b) {
+  while (p != end && !is_whitespace(*p) && *p != a && *p != b) ++p;
+  return p;
+}
+
+//The '*/' closing a comment at or behind p, or nullptr.
+inline const char * find_comment_end(const char * p, const char * end) {
+  while (end - p >= 2) {
+    p = (const char *)std::memchr(p, '*', end - p - 1);
+    if (!p) return nullptr;
+    if (p[1] == '/') return p;
+    ++p;
+  }
+  return nullptr;
+}
+
+std::vector<const char *> input_files;
+
+////////////////////////////////////////////////////////
+// INPUT FILES                                        //
+////////////////////////////////////////////////////////
+
+//A zero terminated view of an input file. Regular files are memory mapped and
+//scanned in place, everything else (pipes, stdin via "-") is read into the heap.
+struct input_file {
+  const char * data = "";
+  size_t size = 0;
+  void * view = nullptr; //mapped memory, must be unmapped
+  char * heap = nullptr; //fallback memory, must be freed
+};
+
+bool read_input_stream(input_file & file, FILE * f) {
+  size_t capacity = 64 * 1024;
+  size_t size = 0;
+  char * heap = (char *)malloc(capacity + 1);
+  if (!heap) return false;
+  for (;;) {
+    size_t read = fread(heap + size, 1, capacity - size, f);
+    size += read;
+    if (size != capacity) break;
+    capacity *= 2;
+    char * grown = (char *)realloc(heap, capacity + 1);
+    if (!grown) {
+      free(heap);
+      return false;
+    }
+    heap = grown;
+  }
+  heap[size] = 0;
+  file.heap = heap;
+  file.data = heap;
+  file.size = size;
+  return true;
+}
+
+bool read_input_fallback(input_file & file, const char * path) {
+  FILE * f = fopen(path, "rb");
+  if (!f) return false;
+  bool ok = read_input_stream(file, f);
+  fclose(f);
+  return ok;
+}
+
+//Maps the file. Empty files, pipes and files that can't be mapped are read
+//into memory instead.
+bool open_input(input_file & file, const char * path) {
+  if (is_equal(path, "-")) return read_input_stream(file, stdin);
+
+#ifdef _WIN32
+  HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (h == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER file_size = {};
+  if (GetFileType(h) != FILE_TYPE_DISK || !GetFileSizeEx(h, &file_size) || file_size.QuadPart == 0) {
+    CloseHandle(h);
+    return read_input_fallback(file, path);
+  }
+
+  HANDLE mapping = CreateFileMappingA(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void * view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  if (mapping) CloseHandle(mapping); //the view keeps the mapping alive
+  CloseHandle(h);
+  if (!view) return read_input_fallback(file, path);
+
+  file.size = (size_t)file_size.QuadPart;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return read_input_fallback(file, path);
+  }
+
+  void * view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); //the mapping stays valid after closing the descriptor
+  if (view == MAP_FAILED) return read_input_fallback(file, path);
+  madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  file.size = (size_t)st.st_size;
+#endif
+  file.view = view;
+  file.data = (const char *)view;
+  return true;
+}
+
+void close_input(input_file & file) {
+  if (file.view) {
+#ifdef _WIN32
+    UnmapViewOfFile(file.view);
+#else
+    munmap(file.view, file.size);
+#endif
+  }
+  free(file.heap);
+  file = input_file();
+}
+
+////////////////////////////////////////////////////////
+// SCANNER                                            //
+////////////////////////////////////////////////////////
+
+//Offsets of the newlines in a buffer, see position().
+struct newline_index {
+  std::vector<uint32_t> offsets;
+};
+
+//A cursor over buffer_size bytes, the buffer doesn't need to be zero terminated
+//(e.g. a chunk of a file). Only the byte offset is tracked, lines and columns
+//are resolved by position() when a message needs them.
+struct scanner {
+  const char * buffer = "";
+  size_t buffer_head = 0;
+  size_t buffer_size = 0;
+  bool eof = true;
+  const char * path = "";
+  //line of the first byte
+  int first_line = 1;
+  //set if the buffer is a part of origin, lines are resolved there
+  const scanner * origin = nullptr;
+  size_t origin_offset = 0;
+  mutable std::unique_ptr<newline_index> newlines;
+
+  static bool is_ws(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+  void load_mem(const char * mem, size_t size) {
+    buffer = mem;
+    buffer_head = 0;
+    buffer_size = size;
+    eof = buffer_size == 0;
+  }
+
+  void load_mem(const char * mem) {
+    load_mem(mem, std::strlen(mem));
+  }
+
+  char peek() const { return eof ? 0 : buffer[buffer_head]; }
+
+  char get() {
+    if (eof) return 0;
+    char c = buffer[buffer_head++];
+    eof = buffer_head >= buffer_size;
+    return c;
+  }
+
+  void skip(size_t n) {
+    if (eof) return;
+    buffer_head = std::min(buffer_head + n, buffer_size);
+    eof = buffer_head >= buffer_size;
+  }
+
+  void skip_ws() {
+    while (!eof && is_ws(buffer[buffer_head])) ++buffer_head;
+    eof = buffer_head >= buffer_size;
+  }
+
+  char sws_peek() {
+    skip_ws();
+    return peek();
+  }
+
+  char sws_get() {
+    skip_ws();
+    return get();
+  }
+
+  bool test(const char * str) const {
+    size_t l = std::strlen(str);
+    return !eof && buffer_head + l <= buffer_size && std::memcmp(buffer + buffer_head, str, l) == 0;
+  }
+
+  bool test_and_skip(const char * str) {
+    skip_ws();
+    if (!test(str)) return false;
+    skip(std::strlen(str));
+    return true;
+  }
+
+  //Skips the rest of the line, including the newline.
+  void skip_line() {
+    if (eof) return;
+    const char * line_end = (const char *)std::memchr(buffer + buffer_head, '\n', buffer_size - buffer_head);
+    buffer_head = line_end ? line_end - buffer + 1 : buffer_size;
+    eof = buffer_head >= buffer_size;
+  }
+
+  //Reads the name of a '//@' annotation and skips the rest of its line.
+  template<size_t N>
+  bool test_annotation(char(&dst)[N]) {
+    skip_ws();
+    if (!test("//@")) return false;
+    skip(3);
+    read_till(dst, WHITESPACE);
+    skip_line();
+    return true;
+  }
+
+  void read_till(char * dst, size_t size, const char * delims) {
+    size_t i = 0;
+    while (!eof && !std::strchr(delims, buffer[buffer_head]) && i + 1 < size) dst[i++] = get();
+    dst[i] = 0;
+  }
+
+  template<size_t N>
+  void read_till(char(&dst)[N], const char * delims) {
+    read_till(dst, N, delims);
+  }
+
+  template<size_t N>
+  void sws_read_till(char(&dst)[N], const char * delims) {
+    skip_ws();
+    read_till(dst, delims);
+  }
+
+  template<size_t N>
+  void sws_read_c_identifier(char(&dst)[N]) {
+    skip_ws();
+    size_t i = 0;
+    for (;;) {
+      char c = peek();
+      bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+      if (!ok || i + 1 >= N) break;
+      dst[i++] = get();
+    }
+    dst[i] = 0;
+  }
+};
+
+struct text_position {
+  int line;
+  int column;
+};
+
+text_position position(const scanner & buffer, size_t offset);
+
+void error(const char * msg, scanner & buffer) {
+  char tmp[20] = "";
+  buffer.skip_ws();
+  text_position pos = position(buffer, buffer.buffer_head);
+  buffer.read_till(tmp, WHITESPACE);
+  fprintf(stderr, "%s: %s(%i,%i) [found '%s']" ENDL, msg, buffer.path, pos.line, pos.column, tmp);
+  exit(1);
+}
+
+////////////////////////////////////////////////////////
+// ANNOTATIONS                                        //
+////////////////////////////////////////////////////////
+
+//The names behind '//@'. Unknown names decode to NONE and are ignored.
+template<class T>
+struct annotation_name {
+  std::string_view name;
+  T value;
+};
+
+constexpr annotation_name<member_annotations_t> member_annotation_names[] = {
+  { "NONE", member_annotations_t::NONE },
+  { "Ignore", member_annotations_t::Ignore },
+  { "String", member_annotations_t::String },
+  { "Data", member_annotations_t::Data },
+};
+
+constexpr annotation_name<global_annotations_t> global_annotation_names[] = {
+  { "NONE", global_annotations_t::NONE },
+  { "Flag", global_annotations_t::Flag },
+  { "Imposter", global_annotations_t::Imposter },
+};
+
+//Annotations that only steer the parser, they aren't exported with -J.
+enum class parser_annotations_t {
+  NONE = 0,
+  Root,
+};
+
+constexpr annotation_name<parser_annotations_t> parser_annotation_names[] = {
+  { "NONE", parser_annotations_t::NONE },
+  { "Root", parser_annotations_t::Root },
+};
+
+template<class T, size_t N>
+T decode_annotation(const annotation_name<T>(&names)[N], const char * begin, const char * end) {
+  std::string_view name(begin, end - begin);
+  for (auto & entry : names) {
+    if (entry.name == name) return entry.value;
+  }
+  return T::NONE;
+}
+
+////////////////////////////////////////////////////////
+// KEYWORDS                                           //
+////////////////////////////////////////////////////////
+
+enum class keyword_t {
+  NONE = 0,
+  Namespace,
+  Enum,
+  Struct,
+  Include,
+  Pragma,
+  Define,
+  Ifdef,
+  Ifndef,
+  If,
+  Else,
+  Elif,
+  Endif,
+  Undef,
+};
+
+struct keyword_info {
+  const char * text;
+  size_t length;
+  keyword_t keyword;
+};
+
+constexpr keyword_info keywords[] = {
+  { "namespace", 9, keyword_t::Namespace },
+  { "enum", 4, keyword_t::Enum },
+  { "struct", 6, keyword_t::Struct },
+  { "include", 7, keyword_t::Include },
+  { "pragma", 6, keyword_t::Pragma },
+  { "define", 6, keyword_t::Define },
+  { "ifdef", 5, keyword_t::Ifdef },
+  { "ifndef", 6, keyword_t::Ifndef },
+  { "if", 2, keyword_t::If },
+  { "else", 4, keyword_t::Else },
+  { "elif", 4, keyword_t::Elif },
+  { "endif", 5, keyword_t::Endif },
+  { "undef", 5, keyword_t::Undef },
+};
+
+constexpr size_t keyword_slot_count = 32;
+
+//Perfect hash over the keywords above: length, first and last character select
+//a unique slot. Verified at compile time, adjust it when adding keywords.
+constexpr size_t keyword_slot(const char * text, size_t length) {
+  return (length * 5 + (unsigned char)text[0] + (unsigned char)text[length - 1]) & (keyword_slot_count - 1);
+}
+
+struct keyword_table {
+  //index into keywords + 1, 0 = empty
+  unsigned char slots[keyword_slot_count] = {};
+
+  constexpr keyword_table() {
+    for (size_t i = 0; i != sizeof(keywords) / sizeof(keywords[0]); ++i) {
+      slots[keyword_slot(keywords[i].text, keywords[i].length)] = (unsigned char)(i + 1);
+    }
+  }
+};
+
+constexpr bool keyword_slots_are_unique() {
+  constexpr size_t N = sizeof(keywords) / sizeof(keywords[0]);
+  for (size_t i = 0; i != N; ++i) {
+    for (size_t j = i + 1; j != N; ++j) {
+      if (keyword_slot(keywords[i].text, keywords[i].length) == keyword_slot(keywords[j].text, keywords[j].length)) return false;
+    }
+  }
+  return true;
+}
+static_assert(keyword_slots_are_unique(), "keyword_slot() has collisions.");
+
+constexpr keyword_table keyword_lookup;
+
+inline bool is_identifier_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+//Classifies the identifier at the cursor with a single read. Keywords are
+//consumed, anything else is left untouched.
+keyword_t read_keyword(scanner & buffer) {
+  const char * p = buffer.buffer + buffer.buffer_head;
+  size_t left = buffer.buffer_size - buffer.buffer_head;
+  size_t length = 0;
+  while (length != left && is_identifier_char(p[length])) ++length;
+  if (length == 0) return keyword_t::NONE;
+
+  unsigned char slot = keyword_lookup.slots[keyword_slot(p, length)];
+  if (slot == 0) return keyword_t::NONE;
+
+  const keyword_info & info = keywords[slot - 1];
+  if (info.length != length || std::memcmp(info.text, p, length) != 0) return keyword_t::NONE;
+
+  buffer.skip((int)length);
+  return info.keyword;
+}
+
+////////////////////////////////////////////////////////
+// CONSTANT EXPRESSIONS                               //
+////////////////////////////////////////////////////////
+
+//Resolves an identifier to a value. Returns false if it can't be resolved.
+typedef bool (*constant_lookup_t)(void * user, const char * name, size_t length, long long & value);
+
+//Integer constant expressions with the C operators, like '1 << 4' or
+//'A && !defined(B)'. 'defined' is only understood in preprocessor conditions.
+struct constant_expression {
+  const char * p;
+  const char * end;
+  constant_lookup_t lookup;
+  void * user;
+  bool allow_defined;
+  bool ok;
+};
+
+long long evaluate_binary(constant_expression & e, int min_precedence);
+
+inline void expression_skip_ws(constant_expression & e) {
+  while (e.p != e.end && is_whitespace(*e.p)) ++e.p;
+}
+
+long long evaluate_number(constant_expression & e) {
+  const char * p = e.p;
+  int base = 10;
+  if (p[0] == '0' && p + 1 != e.end && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    p += 2;
+  }
+  else if (p[0] == '0' && p + 1 != e.end && (p[1] == 'b' || p[1] == 'B')) {
+    base = 2;
+    p += 2;
+  }
+  else if (p[0] == '0') {
+    base = 8;
+  }
+
+  unsigned long long value = 0;
+  for (; p != e.end; ++p) {
+    char c = *p;
+    int digit;
+    if (c >= '0' && c <= '9') digit = c - '0';
+    else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+    else break;
+    if (digit >= base) break;
+    value = value * base + digit;
+  }
+  //integer suffixes
+  while (p != e.end && (*p == 'u' || *p == 'U' || *p == 'l' || *p == 'L')) ++p;
+  if (p != e.end && is_identifier_char(*p)) e.ok = false;
+  e.p = p;
+  return (long long)value;
+}
+
+long long evaluate_unary(constant_expression & e) {
+  expression_skip_ws(e);
+  if (e.p == e.end) {
+    e.ok = false;
+    return 0;
+  }
+
+  char c = *e.p;
+  switch (c) {
+  case '-': ++e.p; return -evaluate_unary(e);
+  case '+': ++e.p; return evaluate_unary(e);
+  case '!': ++e.p; return !evaluate_unary(e);
+  case '~': ++e.p; return ~evaluate_unary(e);
+  case '(': {
+    ++e.p;
+    long long value = evaluate_binary(e, 0);
+    expression_skip_ws(e);
+    if (e.p == e.end || *e.p != ')') e.ok = false;
+    else ++e.p;
+    return value;
+  }
+  default:
+    break;
+  }
+
+  if (c >= '0' && c <= '9') return evaluate_number(e);
+
+  if (is_identifier_char(c)) {
+    const char * name = e.p;
+    while (e.p != e.end && is_identifier_char(*e.p)) ++e.p;
+    size_t length = e.p - name;
+
+    if (e.allow_defined && length == 7 && std::memcmp(name, "defined", 7) == 0) {
+      expression_skip_ws(e);
+      bool parenthesis = e.p != e.end && *e.p == '(';
+      if (parenthesis) ++e.p;
+      expression_skip_ws(e);
+      const char * macro = e.p;
+      while (e.p != e.end && is_identifier_char(*e.p)) ++e.p;
+      long long ignored;
+      bool defined = e.p != macro && e.lookup(e.user, macro, e.p - macro, ignored);
+      if (parenthesis) {
+        expression_skip_ws(e);
+        if (e.p == e.end || *e.p != ')') e.ok = false;
+        else ++e.p;
+      }
+      return defined;
+    }
+
+    long long value = 0;
+    if (!e.lookup(e.user, name, length, value)) {
+      //like the preprocessor: unknown identifiers are 0 in conditions
+      if (!e.allow_defined) e.ok = false;
+      return 0;
+    }
+    return value;
+  }
+
+  e.ok = false;
+  return 0;
+}
+
+//Binary operator at the cursor: returns its precedence (higher binds
+//stronger) or -1. length is the number of characters of the operator.
+int binary_precedence(const constant_expression & e, int & length) {
+  const char * p = e.p;
+  char c = p[0];
+  char n = p + 1 != e.end ? p[1] : 0;
+  length = 2;
+  if (c == '|' && n == '|') return 1;
+  if (c == '&' && n == '&') return 2;
+  if (c == '=' && n == '=') return 6;
+  if (c == '!' && n == '=') return 6;
+  if (c == '<' && n == '<') return 8;
+  if (c == '>' && n == '>') return 8;
+  if (c == '<' && n == '=') return 7;
+  if (c == '>' && n == '=') return 7;
+  length = 1;
+  switch (c) {
+  case '|': return 3;
+  case '^': return 4;
+  case '&': return 5;
+  case '<':
+  case '>': return 7;
+  case '+':
+  case '-': return 9;
+  case '*':
+  case '/':
+  case '%': return 10;
+  default: return -1;
+  }
+}
+
+long long evaluate_binary(constant_expression & e, int min_precedence) {
+  long long lhs = evaluate_unary(e);
+  for (;;) {
+    expression_skip_ws(e);
+    if (e.p == e.end || !e.ok) return lhs;
+
+    int length;
+    int precedence = binary_precedence(e, length);
+    if (precedence < 0 || precedence < min_precedence) return lhs;
+
+    const char * op = e.p;
+    e.p += length;
+    long long rhs = evaluate_binary(e, precedence + 1);
+
+    switch (op[0]) {
+    case '|': lhs = length == 2 ? (lhs || rhs) : (lhs | rhs); break;
+    case '&': lhs = length == 2 ? (lhs && rhs) : (lhs & rhs); break;
+    case '^': lhs = lhs ^ rhs; break;
+    case '=': lhs = lhs == rhs; break;
+    case '!': lhs = lhs != rhs; break;
+    case '<':
+      if (length == 2 && op[1] == '<') lhs = (long long)((unsigned long long)lhs << (rhs & 63));
+      else if (length == 2) lhs = lhs <= rhs;
+      else lhs = lhs < rhs;
+      break;
+    case '>':
+      if (length == 2 && op[1] == '>') lhs = lhs >> (rhs & 63);
+      else if (length == 2) lhs = lhs >= rhs;
+      else lhs = lhs > rhs;
+      break;
+    case '+': lhs = lhs + rhs; break;
+    case '-': lhs = lhs - rhs; break;
+    case '*': lhs = lhs * rhs; break;
+    case '/':
+    case '%':
+      if (rhs == 0) {
+        e.ok = false;
+        return 0;
+      }
+      lhs = op[0] == '/' ? lhs / rhs : lhs % rhs;
+      break;
+    }
+  }
+}
+
+//Evaluates [begin, end). Returns false if it isn't a constant expression.
+bool evaluate_constant(const char * begin, const char * end, long long & value, constant_lookup_t lookup, void * user, bool allow_defined = false) {
+  constant_expression e = { begin, end, lookup, user, allow_defined, true };
+  value = evaluate_binary(e, 0);
+  expression_skip_ws(e);
+  return e.ok && e.p == end;
+}
+
+////////////////////////////////////////////////////////
+// STRUCTURAL INDEX                                   //
+////////////////////////////////////////////////////////
+
+//Offsets of every character that matters when we skip over code we don't
+//parse: braces, ';', '/' (comments), quotes and newlines. The end of a
+//block comment is the first '/' preceded by a '*', so '*' isn't indexed.
+struct structural_index {
+  std::vector<uint32_t> offsets;
+  size_t size = 0; //of the indexed text, lookahead stops there
+};
+
+inline bool is_structural(char c) {
+  switch (c) {
+  case '{':
+  case '}':
+  case ';':
+  case '/':
+  case '"':
+  case '\'':
+  case '\n':
+    return true;
+  default:
+    return false;
+  }
+}
+
+inline int count_trailing_zeros(uint32_t v) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, v);
+  return (int)i;
+#else
+  return __builtin_ctz(v);
+#endif
+}
+
+inline int count_bits(uint32_t v) {
+#ifdef _MSC_VER
+  return (int)__popcnt(v);
+#else
+  return __builtin_popcount(v);
+#endif
+}
+
+inline void push_structural_bits(structural_index & index, size_t offset, uint32_t bits) {
+  while (bits) {
+    index.offsets.push_back((uint32_t)(offset + count_trailing_zeros(bits)));
+    bits &= bits - 1;
+  }
+}
+
+void build_structural_index(structural_index & index, const char * data, size_t size) {
+  index.offsets.clear();
+  index.offsets.reserve(size / 8);
+  index.size = size;
+
+  size_t i = 0;
+#if defined(__AVX2__)
+  {
+    const __m256i lbrace = _mm256_set1_epi8('{');
+    const __m256i rbrace = _mm256_set1_epi8('}');
+    const __m256i semicolon = _mm256_set1_epi8(';');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i squote = _mm256_set1_epi8('\'');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= size; i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+      __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, lbrace), _mm256_cmpeq_epi8(block, rbrace)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(block, semicolon), _mm256_cmpeq_epi8(block, slash))),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, dquote), _mm256_cmpeq_epi8(block, squote)),
+                        _mm256_cmpeq_epi8(block, newline)));
+      push_structural_bits(index, i, (uint32_t)_mm256_movemask_epi8(m));
+    }
+  }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  {
+    const __m128i lbrace = _mm_set1_epi8('{');
+    const __m128i rbrace = _mm_set1_epi8('}');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8('\'');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+      __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, lbrace), _mm_cmpeq_epi8(block, rbrace)),
+                     _mm_or_si128(_mm_cmpeq_epi8(block, semicolon), _mm_cmpeq_epi8(block, slash))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, dquote), _mm_cmpeq_epi8(block, squote)),
+                     _mm_cmpeq_epi8(block, newline)));
+      push_structural_bits(index, i, (uint32_t)_mm_movemask_epi8(m));
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    if (is_structural(data[i])) index.offsets.push_back((uint32_t)i);
+  }
+}
+
+//First index entry at or behind offset.
+size_t structural_find(const structural_index & index, size_t offset) {
+  auto it = std::lower_bound(index.offsets.begin(), index.offsets.end(), (uint32_t)offset);
+  return it - index.offsets.begin();
+}
+
+//Moves the cursor forward to offset.
+void structural_jump(scanner & buffer, size_t offset) {
+  if (offset >= buffer.buffer_size) {
+    offset = buffer.buffer_size;
+    buffer.eof = true;
+  }
+  buffer.buffer_head = offset;
+}
+
+//Advances i to the entry closing the comment or literal that starts at entry i.
+size_t structural_skip_nested(const structural_index & index, const char * data, size_t i) {
+  const auto & offsets = index.offsets;
+  size_t n = offsets.size();
+  size_t start = offsets[i];
+  char c = data[start];
+  char next = start + 1 < index.size ? data[start + 1] : 0;
+
+  if (c == '/' && next == '/') {
+    while (i + 1 < n && data[offsets[i + 1]] != '\n') ++i;
+    return i; //the newline itself is handled by the caller
+  }
+
+  if (c == '/' && next == '*') {
+    for (++i; i < n; ++i) {
+      size_t o = offsets[i];
+      if (data[o] == '/' && o >= start + 3 && data[o - 1] == '*') break;
+    }
+    return i;
+  }
+
+  if (c == '"' || c == '\'') {
+    for (++i; i < n; ++i) {
+      size_t o = offsets[i];
+      if (data[o] == '\n') break; //unterminated literal
+      if (data[o] == c) {
+        size_t backslashes = 0;
+        while (o - backslashes > start && data[o - backslashes - 1] == '\\') ++backslashes;
+        if (backslashes % 2 == 0) break;
+      }
+    }
+    return i;
+  }
+
+  return i;
+}
+
+//Offset behind the matching '}' of the next block at or after offset, or size
+//if there is none. Braces in comments, string and char literals are ignored.
+size_t structural_block_end(const structural_index & index, const char * data, size_t size, size_t offset) {
+  const auto & offsets = index.offsets;
+  size_t n = offsets.size();
+  int depth = 0;
+  for (size_t i = structural_find(index, offset); i < n; ++i) {
+    size_t o = offsets[i];
+    switch (data[o]) {
+    case '{':
+      ++depth;
+      break;
+    case '}':
+      if (--depth <= 0) return o + 1;
+      break;
+    case '/':
+    case '"':
+    case '\'':
+      i = structural_skip_nested(index, data, i);
+      break;
+    }
+  }
+  return size;
+}
+
+//Skips everything up to the matching '}' of the next block.
+void skip_function_body(scanner & buffer, const structural_index & index) {
+  size_t end = structural_block_end(index, buffer.buffer, buffer.buffer_size, buffer.buffer_head);
+  structural_jump(buffer, end);
+}
+
+//Skips whitespaces and the following '//' or '/* */' comment. Annotations
+//('//@') are not comments.
+bool skip_comment(scanner & buffer, const structural_index & index) {
+  buffer.skip_ws();
+  if (buffer.eof) return false;
+
+  const char * data = buffer.buffer;
+  const char * p = data + buffer.buffer_head;
+  size_t left = buffer.buffer_size - buffer.buffer_head;
+  if (left < 2 || p[0] != '/') return false;
+  if (p[1] == '/' && left > 2 && p[2] == '@') return false;
+  if (p[1] != '/' && p[1] != '*') return false;
+
+  size_t i = structural_find(index, buffer.buffer_head);
+  i = structural_skip_nested(index, data, i);
+  if (p[1] == '/') {
+    //like skip_line() the newline is consumed as well
+    if (i + 1 < index.offsets.size()) structural_jump(buffer, index.offsets[i + 1] + 1);
+    else structural_jump(buffer, buffer.buffer_size);
+  }
+  else {
+    if (i < index.offsets.size()) structural_jump(buffer, index.offsets[i] + 1);
+    else structural_jump(buffer, buffer.buffer_size);
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////
+// LINES                                              //
+////////////////////////////////////////////////////////
+
+//The parser doesn't count lines while it scans. They are only needed for
+//messages and the stream windows, so they are counted when asked for.
+
+size_t count_newlines(const char * data, size_t size) {
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= size; i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+      count += count_bits((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    }
+  }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+      count += count_bits((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    if (data[i] == '\n') ++count;
+  }
+  return count;
+}
+
+void build_newline_index(newline_index & index, const char * data, size_t size) {
+  index.offsets.clear();
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+      uint32_t bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+      while (bits) {
+        index.offsets.push_back((uint32_t)(i + count_trailing_zeros(bits)));
+        bits &= bits - 1;
+      }
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    if (data[i] == '\n') index.offsets.push_back((uint32_t)i);
+  }
+}
+
+//Line and column (both starting at 1) of offset. The newline index of the
+//buffer is built on the first call.
+text_position position(const scanner & buffer, size_t offset) {
+  if (buffer.origin) return position(*buffer.origin, buffer.origin_offset + offset);
+
+  //chunks of a file can report errors at the same time
+  static std::mutex lock;
+  std::lock_guard<std::mutex> guard(lock);
+  if (!buffer.newlines) {
+    buffer.newlines.reset(new newline_index);
+    build_newline_index(*buffer.newlines, buffer.buffer, buffer.buffer_size);
+  }
+  const auto & offsets = buffer.newlines->offsets;
+  size_t before = std::lower_bound(offsets.begin(), offsets.end(), (uint32_t)offset) - offsets.begin();
+  size_t line_start = before ? offsets[before - 1] + 1 : 0;
+  return { buffer.first_line + (int)before, (int)(offset - line_start) + 1 };
+}
+
+////////////////////////////////////////////////////////
+// PRESCAN                                            //
+////////////////////////////////////////////////////////
+
+//A header without any of these words can't contribute to the generated code:
+//no structs, enums, annotations or the functions has_compare_ops() looks for.
+enum class reflectable_word_t {
+  Struct,
+  Enum,
+  Annotation,
+  Operator,
+  Serialize,
+  COUNT
+};
+constexpr const char * reflectable_words[] = { "struct", "enum", "//@", "operator", "serialize" };
+constexpr size_t reflectable_word_count = sizeof(reflectable_words) / sizeof(reflectable_words[0]);
+static_assert(reflectable_word_count == (size_t)reflectable_word_t::COUNT, "reflectable_words doesn't match reflectable_word_t.");
+
+struct word_counts {
+  size_t counts[reflectable_word_count] = {};
+  size_t total = 0;
+
+  size_t operator[](reflectable_word_t w) const { return counts[(size_t)w]; }
+};
+
+//Vectorized substring search: blocks are compared against the first and last
+//character of every word, only the hits are verified with memcmp. The counts
+//are an upper bound for the number of declarations.
+void count_reflectable_words(word_counts & result, const char * data, size_t size) {
+  size_t lengths[reflectable_word_count];
+  size_t longest = 0;
+  for (size_t w = 0; w != reflectable_word_count; ++w) {
+    lengths[w] = std::strlen(reflectable_words[w]);
+    if (lengths[w] > longest) longest = lengths[w];
+  }
+
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  __m128i first[reflectable_word_count];
+  __m128i last[reflectable_word_count];
+  for (size_t w = 0; w != reflectable_word_count; ++w) {
+    first[w] = _mm_set1_epi8(reflectable_words[w][0]);
+    last[w] = _mm_set1_epi8(reflectable_words[w][lengths[w] - 1]);
+  }
+
+  for (; i + 16 + longest <= size; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    for (size_t w = 0; w != reflectable_word_count; ++w) {
+      __m128i block_last = _mm_loadu_si128((const __m128i *)(data + i + lengths[w] - 1));
+      __m128i m = _mm_and_si128(_mm_cmpeq_epi8(block, first[w]), _mm_cmpeq_epi8(block_last, last[w]));
+      uint32_t bits = (uint32_t)_mm_movemask_epi8(m);
+      while (bits) {
+        size_t o = i + count_trailing_zeros(bits);
+        if (std::memcmp(data + o + 1, reflectable_words[w] + 1, lengths[w] - 2) == 0) ++result.counts[w];
+        bits &= bits - 1;
+      }
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    for (size_t w = 0; w != reflectable_word_count; ++w) {
+      if (size - i >= lengths[w] && std::memcmp(data + i, reflectable_words[w], lengths[w]) == 0) ++result.counts[w];
+    }
+  }
+  for (size_t w = 0; w != reflectable_word_count; ++w) result.total += result.counts[w];
+}
+
+////////////////////////////////////////////////////////
+// PREPROCESSOR                                       //
+////////////////////////////////////////////////////////
+
+//A macro from the command line (-D) or an object like #define.
+struct define_info {
+  char name[64];
+  char value[64];
+};
+
+std::vector<define_info> command_line_defines;
+
+void add_define(std::vector<define_info> & defines, const char * name, const char * name_end, const char * value, const char * value_end) {
+  for (auto & d : defines) {
+    if (std::strlen(d.name) == (size_t)(name_end - name) && std::memcmp(d.name, name, name_end - name) == 0) {
+      copy(d.value, value, value_end);
+      return;
+    }
+  }
+  define_info & d = defines.emplace_back();
+  copy(d.name, name, name_end);
+  copy(d.value, value, value_end);
+}
+
+//NAME=VALUE or NAME (defined as 1)
+void add_define(std::vector<define_info> & defines, const char * arg) {
+  const char * equal = std::strchr(arg, '=');
+  if (equal) add_define(defines, arg, equal, equal + 1, equal + std::strlen(equal));
+  else add_define(defines, arg, arg + std::strlen(arg), "1", "1" + 1);
+}
+
+void remove_define(std::vector<define_info> & defines, const char * name, const char * name_end) {
+  for (size_t i = 0; i != defines.size(); ++i) {
+    if (std::strlen(defines[i].name) == (size_t)(name_end - name) && std::memcmp(defines[i].name, name, name_end - name) == 0) {
+      defines.erase(defines.begin() + i);
+      return;
+    }
+  }
+}
+
+struct define_lookup {
+  const std::vector<define_info> * defines;
+  int depth;
+};
+
+bool lookup_define(void * user, const char * name, size_t length, long long & value) {
+  define_lookup & lookup = *(define_lookup *)user;
+  for (auto & d : *lookup.defines) {
+    if (std::strlen(d.name) != length || std::memcmp(d.name, name, length) != 0) continue;
+    value = 0;
+    if (lookup.depth > 16) return true; //recursive macro
+    define_lookup nested = { lookup.defines, lookup.depth + 1 };
+    if (!evaluate_constant(d.value, d.value + std::strlen(d.value), value, lookup_define, &nested, true)) value = 0;
+    return true;
+  }
+  return false;
+}
+
+//The rest of the current line, without a trailing '//' comment.
+void read_directive_line(scanner & buffer, const char *& begin, const char *& end) {
+  begin = buffer.buffer + buffer.buffer_head;
+  const char * line_end = (const char *)std::memchr(begin, '\n', buffer.buffer_size - buffer.buffer_head);
+  end = line_end ? line_end : buffer.buffer + buffer.buffer_size;
+  for (const char * p = begin; p + 1 < end; ++p) {
+    if (p[0] == '/' && (p[1] == '/' || p[1] == '*')) {
+      end = p;
+      break;
+    }
+  }
+  while (begin != end && is_whitespace(*begin)) ++begin;
+  while (end != begin && is_whitespace(end[-1])) --end;
+}
+
+//Skips the rest of a directive, including lines continued with a '\\'.
+void skip_directive(scanner & buffer) {
+  for (;;) {
+    const char * begin = buffer.buffer + buffer.buffer_head;
+    const char * line_end = (const char *)std::memchr(begin, '\n', buffer.buffer_size - buffer.buffer_head);
+    buffer.skip_line();
+    if (!line_end) return;
+    if (line_end != begin && line_end[-1] == '\r') --line_end;
+    if (line_end == begin || line_end[-1] != '\\') return;
+  }
+}
+
+//Evaluates the condition of #if, #ifdef, #ifndef or #elif. The cursor is behind
+//the directive and will be at the start of the next line. Conditions we can't
+//evaluate (e.g. function like macros) count as false.
+bool evaluate_condition(scanner & buffer, keyword_t directive, const std::vector<define_info> & defines) {
+  const char * begin;
+  const char * end;
+  read_directive_line(buffer, begin, end);
+  skip_directive(buffer);
+
+  define_lookup lookup = { &defines, 0 };
+  long long value = 0;
+  if (directive == keyword_t::Ifdef || directive == keyword_t::Ifndef) {
+    const char * name_end = begin;
+    while (name_end != end && is_identifier_char(*name_end)) ++name_end;
+    bool defined = lookup_define(&lookup, begin, name_end - begin, value);
+    return directive == keyword_t::Ifdef ? defined : !defined;
+  }
+
+  if (!evaluate_constant(begin, end, value, lookup_define, &lookup, true)) return false;
+  return value != 0;
+}
+
+//Skips a disabled conditional block by jumping from one '#' at the start of
+//a line to the next. Nested conditionals are skipped as a whole. Returns the
+//directive that ends the block (Else, Elif or Endif), the cursor is behind it.
+//Returns NONE if the block doesn't end inside the buffer and more input follows.
+keyword_t skip_conditional_block(scanner & buffer, const structural_index & index, bool final) {
+  const char * data = buffer.buffer;
+  const char * end = data + buffer.buffer_size;
+  const char * p = data + buffer.buffer_head;
+  int depth = 0;
+  const auto & offsets = index.offsets;
+  size_t n = offsets.size();
+  size_t i = structural_find(index, buffer.buffer_head);
+
+  while ((p = (const char *)std::memchr(p, '#', end - p)) != nullptr) {
+    //a '#' in a comment or literal isn't a directive, e.g. a commented out #endif
+    size_t offset = p - data;
+    bool hidden = false;
+    for (; i < n && offsets[i] < offset; ++i) {
+      size_t closing = structural_skip_nested(index, data, i);
+      if (closing == i) continue;
+      if (closing >= n || offsets[closing] > offset) {
+        hidden = true;
+        p = closing < n ? data + offsets[closing] + 1 : end;
+        i = closing + 1;
+        break;
+      }
+      i = closing;
+    }
+    if (hidden) continue;
+
+    const char * line = p;
+    while (line != data && (line[-1] == ' ' || line[-1] == '\t')) --line;
+    ++p;
+    if (line != data && line[-1] != '\n') continue; //not the first character on its line
+
+    while (p != end && (*p == ' ' || *p == '\t')) ++p;
+    structural_jump(buffer, p - data);
+    keyword_t directive = read_keyword(buffer);
+    p = data + buffer.buffer_head;
+
+    switch (directive) {
+    case keyword_t::If:
+    case keyword_t::Ifdef:
+    case keyword_t::Ifndef:
+      ++depth;
+      break;
+    case keyword_t::Endif:
+      if (depth-- == 0) return directive;
+      break;
+    case keyword_t::Else:
+    case keyword_t::Elif:
+      if (depth == 0) return directive;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (!final) return keyword_t::NONE;
+  structural_jump(buffer, buffer.buffer_size);
+  error("missing #endif", buffer);
+  return keyword_t::NONE;
+}
+
+////////////////////////////////////////////////////////
+// LEXER                                              //
+////////////////////////////////////////////////////////
+
+enum class token_kind_t : unsigned char {
+  NONE = 0,
+  Identifier,
+  Number,
+  Literal,     //string or char literal
+  Punctuation, //always a single character
+  Annotation,  //the word behind '//@'
+  Block,       //a whole '{...}', e.g. an inline function body
+};
+
+struct token_info {
+  uint32_t offset;
+  uint32_t length;
+  token_kind_t kind;
+};
+
+inline bool is_punctuation(const token_info & t, const char * data, char c) {
+  return t.kind == token_kind_t::Punctuation && data[t.offset] == c;
+}
+
+//Tokens without whitespace or comments between them.
+inline bool tokens_touch(const token_info & a, const token_info & b) {
+  return a.offset + a.length == b.offset;
+}
+
+//Tokenizes a struct body starting behind its '{'. Comments are dropped, nested
+//blocks become a single Block token. The last token is the closing '}' unless
+//the file ended before. Returns the offset behind the last token.
+size_t lex_struct_body(std::vector<token_info> & tokens, const char * data, size_t size, size_t offset, const structural_index & index) {
+  tokens.clear();
+  const char * p = data + offset;
+  const char * end = data + size;
+
+  auto push = [&](const char * begin, const char * last, token_kind_t kind) {
+    tokens.push_back({ (uint32_t)(begin - data), (uint32_t)(last - begin), kind });
+  };
+
+  while (p < end) {
+    char c = *p;
+    if (is_whitespace(c)) {
+      ++p;
+      continue;
+    }
+
+    if (c == '/' && end - p > 1 && p[1] == '/') {
+      if (end - p > 2 && p[2] == '@') {
+        const char * word = p + 3;
+        const char * word_end = word;
+        while (word_end < end && !is_whitespace(*word_end)) ++word_end;
+        push(word, word_end, token_kind_t::Annotation);
+      }
+      const char * line_end = (const char *)std::memchr(p, '\n', end - p);
+      p = line_end ? line_end + 1 : end;
+      continue;
+    }
+
+    if (c == '/' && end - p > 1 && p[1] == '*') {
+      const char * comment_end = find_comment_end(p + 2, end);
+      p = comment_end ? comment_end + 2 : end;
+      continue;
+    }
+
+    const char * begin = p;
+    if (is_identifier_char(c)) {
+      token_kind_t kind = (c >= '0' && c <= '9') ? token_kind_t::Number : token_kind_t::Identifier;
+      while (p < end && (is_identifier_char(*p) || (kind == token_kind_t::Number && *p == '.'))) ++p;
+      push(begin, p, kind);
+    }
+    else if (c == '"' || c == '\'') {
+      for (++p; p < end && *p != c && *p != '\n'; ++p) {
+        if (*p == '\\' && p + 1 < end) ++p;
+      }
+      if (p < end && *p == c) ++p;
+      push(begin, p, token_kind_t::Literal);
+    }
+    else if (c == '{') {
+      p = data + structural_block_end(index, data, size, begin - data);
+      push(begin, p, token_kind_t::Block);
+    }
+    else {
+      ++p;
+      push(begin, p, token_kind_t::Punctuation);
+      if (c == '}') break;
+    }
+  }
+  return p - data;
+}
+
+////////////////////////////////////////////////////////
+// STRING POOL                                        //
+////////////////////////////////////////////////////////
+
+//Handle of an interned string. Equal strings of one pool have the same
+//handle, 0 is the empty string.
+typedef uint32_t string_id;
+
+constexpr string_id no_string = UINT32_MAX;
+constexpr size_t string_block_size = 64 * 1024;
+
+struct string_pool {
+  //zero terminated text of all strings, blocks never move
+  std::vector<std::unique_ptr<char[]>> blocks;
+  size_t block_used = 0;
+  size_t block_size = 0;
+  std::vector<std::string_view> strings = { std::string_view("", 0) };
+  std::unordered_map<std::string_view, string_id> ids = { { std::string_view("", 0), 0 } };
+};
+
+string_id intern(string_pool & pool, const char * begin, const char * end) {
+  std::string_view text(begin, end - begin);
+  auto it = pool.ids.find(text);
+  if (it != pool.ids.end()) return it->second;
+
+  if (pool.block_used + text.size() + 1 > pool.block_size) {
+    pool.block_size = std::max(string_block_size, text.size() + 1);
+    pool.blocks.emplace_back(new char[pool.block_size]);
+    pool.block_used = 0;
+  }
+  char * p = pool.blocks.back().get() + pool.block_used;
+  std::memcpy(p, text.data(), text.size());
+  p[text.size()] = 0;
+  pool.block_used += text.size() + 1;
+
+  string_id id = (string_id)pool.strings.size();
+  pool.strings.emplace_back(p, text.size());
+  pool.ids.emplace(pool.strings.back(), id);
+  return id;
+}
+
+string_id intern(string_pool & pool, const char * str) {
+  return intern(pool, str, str + std::strlen(str));
+}
+
+//Handle of str or no_string if it was never interned.
+string_id find_string(const string_pool & pool, const char * str) {
+  auto it = pool.ids.find(std::string_view(str));
+  return it != pool.ids.end() ? it->second : no_string;
+}
+
+inline const char * c_str(const string_pool & pool, string_id id) {
+  return pool.strings[id].data();
+}
+
+////////////////////////////////////////////////////////
+// CHUNKED ARRAY                                      //
+////////////////////////////////////////////////////////
+
+//Append only storage in chunks of a fixed size. Elements never move, so
+//references into it stay valid while it grows.
+template<class T>
+struct chunked_array {
+  static constexpr size_t chunk_size = 256;
+
+  std::vector<std::unique_ptr<T[]>> chunks;
+  size_t count = 0;
+
+  template<class A>
+  struct iterator_base {
+    A * array;
+    size_t i;
+    auto & operator*() const { return (*array)[i]; }
+    auto * operator->() const { return &(*array)[i]; }
+    iterator_base & operator++() { ++i; return *this; }
+    bool operator!=(const iterator_base & o) const { return i != o.i; }
+  };
+  typedef iterator_base<chunked_array> iterator;
+  typedef iterator_base<const chunked_array> const_iterator;
+
+  T & operator[](size_t i) { return chunks[i / chunk_size][i % chunk_size]; }
+  const T & operator[](size_t i) const { return chunks[i / chunk_size][i % chunk_size]; }
+  size_t size() const { return count; }
+
+  void reserve(size_t n) {
+    while (chunks.size() * chunk_size < n) chunks.emplace_back(new T[chunk_size]());
+  }
+
+  T & emplace_back() {
+    reserve(count + 1);
+    return (*this)[count++];
+  }
+
+  void push_back(const T & value) { emplace_back() = value; }
+
+  iterator begin() { return { this, 0 }; }
+  iterator end() { return { this, count }; }
+  const_iterator begin() const { return { this, 0 }; }
+  const_iterator end() const { return { this, count }; }
+};
+
+//A run of elements of a chunked_array, e.g. the members of one struct.
+template<class T>
+struct chunked_range {
+  typedef typename chunked_array<T>::const_iterator const_iterator;
+
+  const chunked_array<T> * array;
+  size_t first;
+  size_t count;
+
+  const T & operator[](size_t i) const { return (*array)[first + i]; }
+  size_t size() const { return count; }
+  const_iterator begin() const { return { array, first }; }
+  const_iterator end() const { return { array, first + count }; }
+};
+
+////////////////////////////////////////////////////////
+// IR                                                 //
+////////////////////////////////////////////////////////
+
+//What the parser produces. Mirrors the types of parser.h, but strings are
+//handles into the string pool of the context. The types of parser.h are only
+//filled for the JSON dump and the type hashes.
+namespace ir {
+
+//Index into context::namespaces, 0 is the global namespace.
+typedef uint32_t namespace_id;
+
+//Namespaces form a tree shared by all declarations of a context.
+struct namespace_node {
+  namespace_id parent = 0;
+  string_id name = 0;
+  //"a::b::", the qualified names of the declarations inside start with it
+  string_id prefix = 0;
+};
+
+struct member_info {
+  Member_info_kind kind = Member_info_kind::NONE;
+  string_id type = 0;
+  string_id name = 0;
+  string_id default_value = 0;
+  int count = 0;
+  member_annotations_t annotations = member_annotations_t::NONE;
+};
+
+struct struct_info {
+  string_id name_withns = 0;
+  string_id name_withoutns = 0;
+  namespace_id ns = 0;
+  //in context::files
+  uint32_t file = 0;
+  global_annotations_t global_annotations = global_annotations_t::NONE;
+  //in context::members
+  uint32_t first_member = 0;
+  uint32_t member_count = 0;
+  //fields of this struct and of the types they use, see fingerprint_types()
+  RHash fingerprint = 0;
+  //annotated with //@Root
+  bool root = false;
+  //false if it isn't reachable from the roots, see prune_types()
+  bool emit = true;
+};
+
+struct enum_info {
+  string_id name = 0;
+  string_id value = 0;
+  value_type_t value_type = value_type_t::Increment;
+  //the value as a number, if the enum class is folded
+  long long number = 0;
+};
+
+struct enum_class_info {
+  string_id name_withns = 0;
+  string_id name_withoutns = 0;
+  string_id type = 0;
+  bool custom_type = false;
+  //in context::enums
+  uint32_t first_enum = 0;
+  uint32_t enum_count = 0;
+  namespace_id ns = 0;
+  //in context::files
+  uint32_t file = 0;
+  enum_info default_value;
+  global_annotations_t enum_annotations = global_annotations_t::NONE;
+
+  //all values are constant expressions, the numbers below are valid
+  bool folded = false;
+  long long min_value = 0;
+  long long max_value = 0;
+  //every number from min_value to max_value is used exactly once
+  bool dense = false;
+  //annotated with //@Root
+  bool root = false;
+  //false if it isn't reachable from the roots, see prune_types()
+  bool emit = true;
+};
+
+struct function_parameter_info {
+  string_id name = 0;
+  string_id type = 0;
+  char modifier = 0;
+  bool is_const = false;
+};
+
+struct function_info {
+  string_id name = 0;
+  string_id type = 0;
+  //in context::parameters
+  uint32_t first_parameter = 0;
+  uint32_t parameter_count = 0;
+};
+
+struct context {
+  string_pool strings;
+  std::vector<namespace_node> namespaces = { namespace_node() };
+  //(parent << 32 | name) -> child
+  std::unordered_map<uint64_t, namespace_id> namespace_children;
+  chunked_array<enum_class_info> enum_classes;
+  chunked_array<enum_info> enums;
+  chunked_array<function_info> functions;
+  chunked_array<function_parameter_info> parameters;
+  chunked_array<struct_info> structs;
+  chunked_array<member_info> members;
+  //names of the quoted #includes in enabled code, in order of appearance
+  std::vector<string_id> includes;
+  //paths of the parsed files, see --shard-by
+  std::vector<string_id> files;
+};
+
+}
+
+inline chunked_range<ir::member_info> members(const ir::context & c, const ir::struct_info & structi) {
+  return { &c.members, structi.first_member, structi.member_count };
+}
+
+inline chunked_range<ir::enum_info> enums(const ir::context & c, const ir::enum_class_info & enumci) {
+  return { &c.enums, enumci.first_enum, enumci.enum_count };
+}
+
+inline chunked_range<ir::function_parameter_info> parameters(const ir::context & c, const ir::function_info & funci) {
+  return { &c.parameters, funci.first_parameter, funci.parameter_count };
+}
+
+//The text of a handle, for the emitters.
+inline const char * str(const ir::context & c, string_id id) {
+  return c_str(c.strings, id);
+}
+
+inline string_id intern(ir::context & c, const char * begin, const char * end) {
+  return intern(c.strings, begin, end);
+}
+
+inline string_id intern(ir::context & c, const char * str) {
+  return intern(c.strings, str);
+}
+
+////////////////////////////////////////////////////////
+// ENUM VALUES                                        //
+////////////////////////////////////////////////////////
+
+struct enumerator_lookup {
+  const ir::context * c;
+  uint32_t first;
+  //enumerators in front of the one that is folded
+  uint32_t count;
+};
+
+//Resolves the name of an earlier enumerator of the same enum class.
+bool lookup_enumerator(void * user, const char * name, size_t length, long long & value) {
+  enumerator_lookup & lookup = *(enumerator_lookup *)user;
+  for (uint32_t i = lookup.count; i-- != 0;) {
+    const ir::enum_info & enumi = lookup.c->enums[lookup.first + i];
+    std::string_view text = lookup.c->strings.strings[enumi.name];
+    if (text.size() == length && std::memcmp(text.data(), name, length) == 0) {
+      value = enumi.number;
+      return true;
+    }
+  }
+  return false;
+}
+
+//Folds the values of an enum class to numbers. Set values are evaluated and
+//may refer to earlier enumerators, Increment values follow the one before.
+//The enum class isn't folded if a value isn't a constant expression.
+void fold_enum(ir::context & c, ir::enum_class_info & enumci) {
+  std::vector<long long> numbers;
+  numbers.reserve(enumci.enum_count);
+
+  long long next = 0;
+  for (uint32_t i = 0; i != enumci.enum_count; ++i) {
+    ir::enum_info & enumi = c.enums[enumci.first_enum + i];
+    if (enumi.value_type == value_type_t::Set) {
+      std::string_view text = c.strings.strings[enumi.value];
+      enumerator_lookup lookup = { &c, enumci.first_enum, i };
+      if (!evaluate_constant(text.data(), text.data() + text.size(), enumi.number, lookup_enumerator, &lookup)) return;
+    }
+    else {
+      enumi.number = next;
+    }
+    next = enumi.number + 1;
+    numbers.push_back(enumi.number);
+  }
+  if (numbers.empty()) return;
+
+  std::sort(numbers.begin(), numbers.end());
+  enumci.folded = true;
+  enumci.min_value = numbers.front();
+  enumci.max_value = numbers.back();
+  enumci.dense = std::adjacent_find(numbers.begin(), numbers.end()) == numbers.end() &&
+    (unsigned long long)enumci.max_value - (unsigned long long)enumci.min_value == numbers.size() - 1;
+}
+
+////////////////////////////////////////////////////////
+// NAMESPACES                                         //
+////////////////////////////////////////////////////////
+
+//The namespace name inside parent, created on first use.
+ir::namespace_id namespace_child(ir::context & c, ir::namespace_id parent, string_id name) {
+  uint64_t key = (uint64_t)parent << 32 | name;
+  auto it = c.namespace_children.find(key);
+  if (it != c.namespace_children.end()) return it->second;
+
+  ir::namespace_node node;
+  node.parent = parent;
+  node.name = name;
+  std::string prefix = str(c, c.namespaces[parent].prefix);
+  prefix += str(c, name);
+  prefix += "::";
+  node.prefix = intern(c, prefix.c_str());
+
+  ir::namespace_id id = (ir::namespace_id)c.namespaces.size();
+  c.namespaces.push_back(node);
+  c.namespace_children.emplace(key, id);
+  return id;
+}
+
+ir::namespace_id find_namespace(ir::context & c, const std::vector<std::string> & path) {
+  ir::namespace_id ns = 0;
+  for (auto & name : path) ns = namespace_child(c, ns, intern(c, name.c_str()));
+  return ns;
+}
+
+//The name qualified with the namespaces around it.
+string_id qualified_name(ir::context & c, ir::namespace_id ns, string_id name) {
+  if (ns == 0) return name;
+  std::string qualified = str(c, c.namespaces[ns].prefix);
+  qualified += str(c, name);
+  return intern(c, qualified.c_str());
+}
+
+//Like StreamBuffer::sws_read_till(), but the text stays in the buffer.
+void sws_read_slice(scanner & buffer, const char * delims, const char *& begin, const char *& end) {
+  buffer.skip_ws();
+  begin = buffer.buffer + buffer.buffer_head;
+  end = begin;
+  const char * limit = buffer.buffer + buffer.buffer_size;
+  while (end != limit && !std::strchr(delims, *end)) ++end;
+  buffer.skip((int)(end - begin));
+}
+
+string_id sws_read_string(ir::context & c, scanner & buffer, const char * delims) {
+  const char * begin;
+  const char * end;
+  sws_read_slice(buffer, delims, begin, end);
+  return intern(c, begin, end);
+}
+
+//Parses the members of a struct, the cursor is behind its '{'. Returns with
+//the cursor behind the closing '}'.
+//Members are read as words (runs of touching tokens) up to one of '(' '['
+//';' ',' or a freestanding '=' outside of template arguments. The last word
+//is the name, the ones before form the type. Static members are skipped.
+void parse_struct_members(ir::context & ctx, ir::struct_info & structi, scanner & buffer, const structural_index & index, std::vector<token_info> & tokens) {
+  const char * data = buffer.buffer;
+  size_t end = lex_struct_body(tokens, data, buffer.buffer_size, buffer.buffer_head, index);
+  if (tokens.empty() || !is_punctuation(tokens.back(), data, '}')) {
+    structural_jump(buffer, end);
+    error("Expected '}'", buffer);
+  }
+
+  const size_t last = tokens.size() - 1; //the closing '}'
+  structi.first_member = (uint32_t)ctx.members.size();
+
+  auto fail = [&](const char * msg, size_t t) {
+    structural_jump(buffer, tokens[t].offset);
+    error(msg, buffer);
+  };
+  auto is = [&](size_t t, char c) { return is_punctuation(tokens[t], data, c); };
+  auto is_stop = [&](size_t t) { return is(t, '(') || is(t, '[') || is(t, ';') || is(t, ','); };
+  auto text_begin = [&](size_t t) { return data + tokens[t].offset; };
+  auto text_end = [&](size_t t) { return data + tokens[t].offset + tokens[t].length; };
+  auto is_word = [&](size_t t, std::string_view word) {
+    return tokens[t].kind == token_kind_t::Identifier && std::string_view(text_begin(t), tokens[t].length) == word;
+  };
+  //a '<' that touches a name opens template arguments, unless it's operator<
+  auto opens_template = [&](size_t t) {
+    return is(t, '<') && t != 0 && tokens[t - 1].kind == token_kind_t::Identifier && tokens_touch(tokens[t - 1], tokens[t]) && !is_word(t - 1, "operator");
+  };
+
+  //reads words up to a stop token, returns the index of the first token of the last word.
+  auto read_words = [&](size_t & t, size_t & word_count) {
+    size_t last_word = t;
+    word_count = 0;
+    int angles = 0;
+    auto stops = [&]() { return t == last || is(t, ';') || (angles == 0 && is_stop(t)); };
+    while (!stops() && !(word_count && angles == 0 && is(t, '='))) {
+      last_word = t;
+      ++word_count;
+      do {
+        if (opens_template(t)) ++angles;
+        else if (angles && is(t, '>')) --angles;
+        ++t;
+      } while (!stops() && tokens_touch(tokens[t - 1], tokens[t]));
+    }
+    return last_word;
+  };
+
+  //skips to the token behind the next ';' or block
+  auto skip_declaration = [&](size_t & t) {
+    while (t != last && !is(t, ';') && tokens[t].kind != token_kind_t::Block) ++t;
+    if (t == last) fail("Expected ';'", t);
+    ++t;
+  };
+
+  size_t t = 0;
+  while (t != last) {
+    member_annotations_t annotation = member_annotations_t::NONE;
+
+    //member annotations are flags, several of them are combined
+    while (tokens[t].kind == token_kind_t::Annotation) {
+      annotation |= decode_annotation(member_annotation_names, text_begin(t), text_end(t));
+      ++t;
+    }
+
+    if (is_word(t, "static")) {
+      //not part of an instance, an initializer like '{ 1, 2 }' is followed by ';'
+      skip_declaration(t);
+      if (t != last && is(t, ';')) ++t;
+      continue;
+    }
+
+    ir::member_info memberi;
+    size_t declaration = t;
+    size_t word_count = 0;
+    size_t name = read_words(t, word_count);
+    if (word_count == 0) fail("Expected member", t);
+
+    bool first_declarator = true;
+    for (;;) {
+      memberi.count = 1;
+      memberi.kind = Member_info_kind::Field;
+      memberi.annotations = annotation;
+
+      if (first_declarator) {
+        if (word_count == 1 && is(t, '(')) {
+          memberi.type = intern(ctx, text_begin(declaration), text_end(t - 1));
+          memberi.name = 0;
+        }
+        else {
+          if (word_count == 1) fail("Expected member name", t);
+          memberi.type = intern(ctx, text_begin(declaration), text_end(name - 1));
+          memberi.name = intern(ctx, text_begin(name), text_end(t - 1));
+        }
+      }
+      else {
+        size_t declarator = t;
+        read_words(t, word_count);
+        if (word_count == 0) fail("Expected member name", t);
+        memberi.name = intern(ctx, text_begin(declarator), text_end(t - 1));
+      }
+      first_declarator = false;
+
+      if (t == last) fail("Expected ';'", t);
+
+      bool member_chain = false;
+
+      if (is(t, '(')) {
+        if (memberi.name == 0) {
+          const char * constrcutor_name = str(ctx, memberi.type);
+          // Empty name means we have a constrcutor / destructor
+          memberi.kind = Member_info_kind::Constructor;
+          if (constrcutor_name[0] == '~') {
+            memberi.kind = Member_info_kind::Destructor;
+            constrcutor_name++;
+          }
+          if (!is_equal(constrcutor_name, str(ctx, structi.name_withoutns))) {
+            // Sanity check
+            fail("Constructor / Destructor must have same name", t);
+          }
+        } else {
+          // function
+          memberi.kind = Member_info_kind::Function;
+        }
+
+        //skip the parameter list
+        int depth = 0;
+        do {
+          if (is(t, '(')) ++depth;
+          if (is(t, ')')) --depth;
+          ++t;
+        } while (depth && t != last);
+
+        if (t != last && is(t, '=')) {
+          // We don't care about assigned values for functions
+          // can be 0 or default or delete
+          while (t != last && !is(t, ';')) ++t;
+          if (t == last) fail("Expected ';'", t);
+          ++t;
+        } else {
+          skip_declaration(t);
+        }
+      } else {
+        if (is(t, '[')) {
+          size_t count = ++t;
+          while (t != last && !is(t, ']')) ++t;
+          if (t == last) fail("Expected ']'", t);
+          char tmp[64];
+          copy(tmp, text_begin(count), text_begin(t));
+          memberi.count = atoi(tmp);
+          ++t;
+        }
+
+        if (t == last) fail("Expected ';'", t);
+        member_chain = is(t, ','); //new member with same type and annotations
+        if (is(t, '=')) {
+          size_t value = ++t;
+          while (t != last && !is(t, ';')) ++t;
+          if (t == last) fail("Expected ';'", t);
+          memberi.default_value = intern(ctx, text_begin(value), text_begin(t));
+        }
+        else if (!is(t, ';') && !member_chain) {
+          fail("Expected ';'", t);
+        }
+        ++t;
+      }
+
+      if (!(annotation & member_annotations_t::Ignore)) {
+        ctx.members.push_back(memberi);
+        ++structi.member_count;
+      }
+
+      if (member_chain) continue;
+      else break;
+    }
+  }
+
+  structural_jump(buffer, end);
+}
+
+////////////////////////////////////////////////////////
+// STREAMING                                          //
+////////////////////////////////////////////////////////
+
+//Parser state that is carried from one window of the input to the next.
+struct parse_state {
+  std::vector<std::string> namespaces;
+  std::vector<define_info> defines = command_line_defines;
+  global_annotations_t global_annotation = global_annotations_t::NONE;
+  //the next struct or enum class is annotated with //@Root
+  bool root = false;
+  bool is_in_imposter_comment = false;
+  int conditional_depth = 0;
+  //false if more input follows the buffer
+  bool final = true;
+  //false if the buffer is a chunk from the middle of a file. Chunks end on a
+  //declaration boundary, so only the check for a missing #endif depends on it.
+  bool last_chunk = true;
+  //line the next window starts at, streaming only
+  int line = 1;
+};
+
+constexpr size_t stream_window_size = 4 * 1024 * 1024;
+
+//True if the declaration at the cursor, including the comments and
+//annotations in front of it, ends inside the buffer. The buffer always ends
+//on a line boundary, so directives and line comments are always complete.
+bool declaration_complete(scanner & buffer, const structural_index & index) {
+  const char * data = buffer.buffer;
+  const char * end = data + buffer.buffer_size;
+  const char * p = data + buffer.buffer_head;
+
+  for (;;) {
+    p = skip_whitespace(p, end);
+    if (end - p < 2 || p[0] != '/') break;
+    if (p[1] == '/') {
+      p = (const char *)std::memchr(p, '\n', end - p);
+      if (!p) return true;
+    }
+    else if (p[1] == '*') {
+      p = find_comment_end(p + 2, end);
+      if (!p) return false;
+      p += 2;
+    }
+    else break;
+  }
+
+  if (p == end || *p == '#' || *p == '}') return true;
+  bool is_namespace = end - p > 9 && std::memcmp(p, "namespace", 9) == 0 && !is_identifier_char(p[9]);
+
+  const auto & offsets = index.offsets;
+  size_t n = offsets.size();
+  int depth = 0;
+  for (size_t i = structural_find(index, p - data); i < n; ++i) {
+    size_t o = offsets[i];
+    switch (data[o]) {
+    case '{':
+      if (is_namespace) return true;
+      ++depth;
+      break;
+    case '}':
+      if (--depth <= 0) return true;
+      break;
+    case ';':
+      if (depth == 0) return true;
+      break;
+    case '/':
+    case '"':
+    case '\'':
+      i = structural_skip_nested(index, data, i);
+      if (i >= n) return false;
+      break;
+    }
+  }
+  return false;
+}
+
+//Length of the complete lines at the start of data. Lines continued with a
+//'\\' are not complete.
+size_t complete_lines(const char * data, size_t size) {
+  while (size) {
+    const char * p = data + size - 1;
+    while (p != data && *p != '\n') --p;
+    if (*p != '\n') return 0;
+    size = p - data + 1;
+
+    const char * last = p;
+    if (last != data && last[-1] == '\r') --last;
+    if (last == data || last[-1] != '\\') return size;
+    size = p - data;
   }
+  return 0;
 }
 
-template<size_t N>
-void copy(char(&dst)[N], const char * src) {
-  for (size_t i = 0; i != N; ++i) {
-    dst[i] = src[i];
-    if (dst[i] == 0) break;
+size_t parse(ir::context & ctx, scanner & buffer, parse_state & state);
+
+//Parses a file through a fixed size window that is refilled at declaration
+//boundaries, so memory doesn't grow with the size of the input. The window
+//only grows if a single declaration doesn't fit.
+void parse_stream(ir::context & ctx, const char * path) {
+  FILE * f = is_equal(path, "-") ? stdin : fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Can't open file %s" ENDL, path);
+    exit(1);
   }
-}
 
-std::vector<const char *> input_files;
+  size_t capacity = stream_window_size;
+  char * window = (char *)malloc(capacity);
+  size_t filled = 0;
+  bool file_done = false;
+  parse_state state;
 
-void error(const char * msg, rose::StreamBuffer & buffer) {
-  char tmp[20] = "";
-  buffer.sws_read_till(tmp, WHITESPACE);
-  fprintf(stderr, "%s: %s(%i) [found '%s']" ENDL, msg, buffer.path, buffer.cursor_line, tmp);
-  exit(1);
-}
+  for (;;) {
+    if (!file_done) {
+      filled += fread(window + filled, 1, capacity - filled, f);
+      file_done = filled != capacity;
+    }
+
+    //the last pass runs also on an empty window, e.g. to report a missing #endif
+    size_t usable = file_done ? filled : complete_lines(window, filled);
+    size_t consumed = 0;
+    if (usable || file_done) {
+      scanner buffer;
+      buffer.load_mem(window, usable);
+      buffer.path = path;
+      buffer.first_line = state.line;
+      state.final = file_done;
+      consumed = parse(ctx, buffer, state);
+      state.line += (int)count_newlines(window, consumed);
+      if (state.final) break;
+    }
+
+    if (consumed == 0) {
+      //a single line or declaration doesn't fit, the window is full here
+      char * grown = (char *)realloc(window, capacity * 2);
+      if (!grown) {
+        free(window);
+        fprintf(stderr, "Out of memory while parsing %s" ENDL, path);
+        exit(1);
+      }
+      window = grown;
+      capacity *= 2;
+      continue;
+    }
 
-//str -> "str"
-void quotify(char * str, size_t len, rose::StreamBuffer & buffer) {
-  size_t l = std::strlen(str);
-  if (l >= len - 2) error("string to long", buffer);
-  str[l + 2] = 0;
-  str[l + 1] = '\"';
-  for (size_t i = l; i != 0; --i) {
-    str[i] = str[i - 1];
+    std::memmove(window, window + consumed, filled - consumed);
+    filled -= consumed;
   }
-  str[0] = '\"';
+
+  free(window);
+  if (f != stdin) fclose(f);
 }
 
-template<size_t N>
-void quotify(char(&str)[N], rose::StreamBuffer & buffer) {
-  quotify(str, N, buffer);
+//Reads the name and the '{' of a namespace, behind the keyword.
+void read_namespace(scanner & buffer, std::vector<std::string> & namespaces) {
+  const char * begin;
+  const char * end;
+  sws_read_slice(buffer, "{" WHITESPACE, begin, end);
+  namespaces.emplace_back(begin, end);
+  buffer.test_and_skip("{");
 }
 
-int read_in_namespaces(char * buffer, int N, const std::vector<namespace_path> & namespaces, rose::StreamBuffer & sb) {
-  char * p = buffer;
-  int size = N;
-  int len = 0;
-  for (auto & ns : namespaces) {
-    int s = std::snprintf(p, size, "%s::", ns.path);
-    size -= s;
-    len += s;
-    if (size < 0) error("out of space.", sb);
-    p += s;
+//Handles the directive at the cursor, which is on the '#'. Returns false if a
+//disabled block doesn't end inside the buffer and more input follows.
+//Quoted includes are recorded in ctx, if given.
+bool parse_directive(scanner & buffer, const structural_index & index, parse_state & state, ir::context * ctx) {
+  buffer.skip(1);
+  while (buffer.peek() == ' ' || buffer.peek() == '\t') buffer.skip(1);
+  keyword_t directive = read_keyword(buffer);
+  switch (directive) {
+  case keyword_t::Include: {
+    const char * begin;
+    const char * end;
+    read_directive_line(buffer, begin, end);
+    const char * name_end = begin != end && *begin == '"' ? (const char *)std::memchr(begin + 1, '"', end - begin - 1) : nullptr;
+    if (ctx && name_end) ctx->includes.push_back(intern(*ctx, begin + 1, name_end));
+    skip_directive(buffer);
+    break;
+  }
+  case keyword_t::Pragma:
+    skip_directive(buffer);
+    break;
+  case keyword_t::Define:
+  case keyword_t::Undef: {
+    //object like macros are remembered for #if conditions
+    const char * begin;
+    const char * end;
+    read_directive_line(buffer, begin, end);
+    const char * name_end = begin;
+    while (name_end != end && is_identifier_char(*name_end)) ++name_end;
+    if (directive == keyword_t::Undef) remove_define(state.defines, begin, name_end);
+    else if (name_end != begin && (name_end == end || *name_end != '(')) add_define(state.defines, begin, name_end, skip_whitespace(name_end, end), end);
+    skip_directive(buffer);
+    break;
   }
-  return len;
+  case keyword_t::Ifdef:
+  case keyword_t::Ifndef:
+  case keyword_t::If:
+    if (evaluate_condition(buffer, directive, state.defines)) {
+      ++state.conditional_depth;
+      break;
+    }
+    //disabled: skip to the first branch that is enabled
+    for (;;) {
+      keyword_t found = skip_conditional_block(buffer, index, state.final);
+      //continue with the next window
+      if (found == keyword_t::NONE) return false;
+      if (found == keyword_t::Endif) {
+        skip_directive(buffer);
+        break;
+      }
+      if (found == keyword_t::Else) {
+        skip_directive(buffer);
+        ++state.conditional_depth;
+        break;
+      }
+      if (evaluate_condition(buffer, keyword_t::Elif, state.defines)) {
+        ++state.conditional_depth;
+        break;
+      }
+    }
+    break;
+  case keyword_t::Else:
+  case keyword_t::Elif:
+    //we parsed the enabled branch, skip all others
+    if (state.conditional_depth == 0) error(directive == keyword_t::Else ? "unexpected #else" : "unexpected #elif", buffer);
+    for (;;) {
+      keyword_t found = skip_conditional_block(buffer, index, state.final);
+      if (found == keyword_t::NONE) return false;
+      if (found == keyword_t::Endif) break;
+    }
+    skip_directive(buffer);
+    --state.conditional_depth;
+    break;
+  case keyword_t::Endif:
+    if (state.conditional_depth == 0) error("unexpected #endif", buffer);
+    skip_directive(buffer);
+    --state.conditional_depth;
+    break;
+  default:
+    error("unknown PP macro.", buffer);
+    break;
+  }
+  return true;
 }
 
-template<size_t N>
-int read_in_namespaces(char (&buffer)[N], const std::vector<namespace_path> & namespaces, rose::StreamBuffer & sb) {
-  return read_in_namespaces(buffer, N, namespaces, sb);
-}
+//Parses buffer into ctx. Returns the offset parsing stopped at: the end of the
+//buffer or, if more input follows (state.final is false), the start of the
+//first declaration that doesn't end inside the buffer.
+size_t parse(ir::context & ctx, scanner & buffer, parse_state & state) {
+  structural_index index;
+  build_structural_index(index, buffer.buffer, buffer.buffer_size);
+  std::vector<token_info> tokens;
 
-void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
-  auto skip_function_body = [&buffer]() {
-    int depth = 0;
-    do {
-      //TODO: deal with {} in comments
-      buffer.skip_till_any("{}");
-      char c = buffer.get();
-      depth += c == '{' ? 1 : -1;
-      if (c == 0) break;
-      assert(depth >= 0);
-    } while (depth);
-  };
+  auto & namespaces = state.namespaces;
+  ir::namespace_id ns = find_namespace(ctx, namespaces);
+  auto & global_annotation = state.global_annotation;
+  auto & is_in_imposter_comment = state.is_in_imposter_comment;
 
-  char tmp[64] = "";
-  global_annotations_t global_annotation = global_annotations_t::NONE;
-  bool is_in_imposter_comment = false;
-  std::vector<namespace_path> namespaces;
   while (!buffer.eof) {
+    if (!state.final && !declaration_complete(buffer, index)) return buffer.buffer_head;
+
     ////////////////////////////////////////////////////////
     // COMMENTS                                           //
     ////////////////////////////////////////////////////////
-    while (buffer.skip_comment()) {
+    while (skip_comment(buffer, index)) {
       // TODO: we need a more flexible way to check for comments
     }
 
     ////////////////////////////////////////////////////////
     // GLOBAL ANNOTATION                                  //
     ////////////////////////////////////////////////////////
+    //Imposter applies to the comment that follows, other annotations to the
+    //next declaration
     char annotation_s[64];
-    bool has_annotation = buffer.test_annotation(annotation_s);
-    bool has_second_annotation = buffer.test_annotation(annotation_s);
-
-    if (has_second_annotation) error("No support for more than one global annotations yet.", buffer);
-
-    if (has_annotation) {
-      quotify(annotation_s, buffer);
-      JsonDeserializer jsond(annotation_s);
-      rose::deserialize(global_annotation, jsond);
-
-      if (global_annotation == global_annotations_t::Imposter) {
-        bool ok = buffer.test_and_skip("/*");
-        if (!ok) error("expects '/*' with Imposter annotation.", buffer);
-        is_in_imposter_comment = true;
+    bool has_imposter = false;
+    while (buffer.test_annotation(annotation_s)) {
+      const char * annotation_end = annotation_s + std::strlen(annotation_s);
+      if (decode_annotation(parser_annotation_names, annotation_s, annotation_end) == parser_annotations_t::Root) {
+        state.root = true;
+        continue;
       }
+      global_annotations_t annotation = decode_annotation(global_annotation_names, annotation_s, annotation_end);
+      if (annotation == global_annotations_t::Imposter) has_imposter = true;
+      else if (annotation != global_annotations_t::NONE) global_annotation = annotation;
+    }
+
+    if (has_imposter) {
+      if (global_annotation == global_annotations_t::NONE) global_annotation = global_annotations_t::Imposter;
+      bool ok = buffer.test_and_skip("/*");
+      if (!ok) error("expects '/*' with Imposter annotation.", buffer);
+      is_in_imposter_comment = true;
     }
 
     if (is_in_imposter_comment) {
@@ -183,85 +2207,66 @@ void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
     ////////////////////////////////////////////////////////
     // MACROS                                             //
     ////////////////////////////////////////////////////////
-    if (buffer.test_and_skip("#")) {
+    char first = buffer.sws_peek();
+    if (first == '#') {
       //Macro
-      buffer.read_till(tmp, WHITESPACE);
-      switch (rose::hash(tmp)) { 
-      case rose::hash("include"):
-      case rose::hash("pragma"):
-      case rose::hash("define"):
-        buffer.skip_line();
-        break;
-      case rose::hash("ifdef"):
-      case rose::hash("ifndef"):
-      case rose::hash("if"):
-        //skip all ifXXX macros.
-        buffer.skip_line();
-        for (;;) {
-          if (buffer.sws_peek() == '#') {
-            if (buffer.test("#endif")) {
-              buffer.skip_line();
-              break;
-            }
-          }
-          buffer.skip_line();
-        }
-
-        break;
-      default:
-        error("unknown PP macro.", buffer);
-        break;
-      }
+      size_t directive_start = buffer.buffer_head;
+      if (!parse_directive(buffer, index, state, &ctx)) return directive_start;
       continue;
     }
 
     ////////////////////////////////////////////////////////
     // NAMESPACE                                          //
     ////////////////////////////////////////////////////////
-    if (buffer.test_and_skip("namespace ")) {
-      namespace_path path;
-      buffer.sws_read_till(path.path, "{" WHITESPACE);
-      namespaces.push_back(path);
-      buffer.test_and_skip("{");
-      continue;
-    }
-
-    if (buffer.test_and_skip("}")) {
+    if (first == '}') {
+      buffer.skip(1);
       if (namespaces.size() == 0)
         error("unexpected '}'", buffer);
 
       namespaces.pop_back();
+      ns = ctx.namespaces[ns].parent;
+      continue;
+    }
+
+    keyword_t keyword = read_keyword(buffer);
+
+    if (keyword == keyword_t::Namespace) {
+      read_namespace(buffer, namespaces);
+      ns = namespace_child(ctx, ns, intern(ctx, namespaces.back().c_str()));
       continue;
     }
 
     ////////////////////////////////////////////////////////
     // ENUMS                                              //
     ////////////////////////////////////////////////////////
-    if (buffer.test_and_skip("enum ")) {
+    if (keyword == keyword_t::Enum) {
       if (buffer.test_and_skip("class ") || buffer.test_and_skip("struct ")) {
         if (global_annotation != global_annotations_t::NONE && global_annotation != global_annotations_t::Flag) {
           error("enum class annotation can't be anything other than 'Flag'", buffer);
         }
-        enum_class_info & enumci = ctx.enum_classes.emplace_back();
+        ir::enum_class_info & enumci = ctx.enum_classes.emplace_back();
         enumci.enum_annotations = global_annotation;
         global_annotation = global_annotations_t::NONE;
+        enumci.root = state.root;
+        state.root = false;
 
-        enumci.namespaces = namespaces;
-        int s = read_in_namespaces(enumci.name_withns, namespaces, buffer);
-        buffer.sws_read_till(enumci.name_withoutns, "{:" WHITESPACE);
-        std::strcpy(enumci.name_withns + s, enumci.name_withoutns); //append name to namespaces part
+        enumci.ns = ns;
+        enumci.name_withoutns = sws_read_string(ctx, buffer, "{:" WHITESPACE);
+        enumci.name_withns = qualified_name(ctx, ns, enumci.name_withoutns);
+        enumci.type = intern(ctx, "int");
         char c = buffer.sws_get();
 
         if (c == ':') {
           enumci.custom_type = true;
-          buffer.sws_read_till(enumci.type, "{");
+          enumci.type = sws_read_string(ctx, buffer, "{");
           c = buffer.sws_get();
         }
 
         if (c != '{') error("Expected '{'", buffer);
+        enumci.first_enum = (uint32_t)ctx.enums.size();
 
         for (;;) {
-          while (buffer.skip_comment())
+          while (skip_comment(buffer, index))
           {
             //Skip the comments
           }
@@ -274,24 +2279,27 @@ void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
             break;
           }
 
-          enum_info & enumi = enumci.enums.emplace_back();
-          buffer.sws_read_till(enumi.name, ",=}" WHITESPACE);
+          ir::enum_info & enumi = ctx.enums.emplace_back();
+          ++enumci.enum_count;
+          enumi.name = sws_read_string(ctx, buffer, ",=}" WHITESPACE);
+          enumi.value = intern(ctx, "0");
           c = buffer.sws_peek();
           if (c == '=') {
             buffer.skip(1);
             enumi.value_type = value_type_t::Set;
-            buffer.sws_read_till(enumi.value, ",}");
+            enumi.value = sws_read_string(ctx, buffer, ",}");
             c = buffer.sws_peek();
           }
           if (c == ',') buffer.skip(1);
         }
 
-        if (enumci.enums.size() > 0) {
-          enumci.enums[0].value_type = value_type_t::Set;
+        if (enumci.enum_count > 0) {
+          ctx.enums[enumci.first_enum].value_type = value_type_t::Set;
         }
 
-        assert(enumci.enums.size() != 0);
-        enumci.default_value = enumci.enums[0];
+        assert(enumci.enum_count != 0);
+        fold_enum(ctx, enumci);
+        enumci.default_value = ctx.enums[enumci.first_enum];
       }
       else {
         error("expected 'class' after 'enum'.", buffer);
@@ -302,107 +2310,24 @@ void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
     ////////////////////////////////////////////////////////
     // STRUCTS                                            //
     ////////////////////////////////////////////////////////
-    if (buffer.test_and_skip("struct ")) {
-      struct_info & structi = ctx.structs.emplace_back();
+    if (keyword == keyword_t::Struct) {
+      ir::struct_info & structi = ctx.structs.emplace_back();
 
       structi.global_annotations = global_annotation;
       global_annotation = global_annotations_t::NONE;
+      structi.root = state.root;
+      state.root = false;
 
-      structi.namespaces = namespaces;
-      int s = read_in_namespaces(structi.name_withns, namespaces, buffer);
-      buffer.sws_read_till(structi.name_withoutns, ";{" WHITESPACE);
-      std::strcpy(structi.name_withns + s, structi.name_withoutns);
+      structi.ns = ns;
+      structi.name_withoutns = sws_read_string(ctx, buffer, ";{" WHITESPACE);
+      structi.name_withns = qualified_name(ctx, ns, structi.name_withoutns);
 
       buffer.skip_ws();
 
       char c = buffer.get();
       if (c == '{') {
-        for (;;) {
-          member_annotations_t annotation = member_annotations_t::NONE;
-          member_info ignored_member; //in case we want to ignore the member
-
-          char annotation_s[64];
-          if (buffer.test_annotation(annotation_s)) {
-            quotify(annotation_s, buffer);
-            JsonDeserializer jsond(annotation_s);
-            rose::deserialize(annotation, jsond);
-          }
-          if (buffer.test_annotation(annotation_s)) {
-            error("No support for double annotations yet.", buffer);
-          }
-          if (buffer.skip_comment()) {
-            ; // we skiped the comment
-          }
-
-          member_info memberi;
-          buffer.sws_read_till(memberi.type, "(" WHITESPACE);
-
-          for (;;) {
-              memberi.count = 1;
-              memberi.kind = Member_info_kind::Field;
-              memberi.annotations = annotation;
-              buffer.sws_read_till(memberi.name, "([;," WHITESPACE);
-              c = buffer.sws_get();
-
-              bool member_chain = false;
-
-              if (c == '(') {
-
-                if (is_empty(memberi.name)) {
-                    char * constrcutor_name = memberi.type;
-                    // Empty name means we have a constrcutor / destructor
-                    memberi.kind = Member_info_kind::Constructor;
-                    if (constrcutor_name[0] == '~') {
-                        memberi.kind = Member_info_kind::Destructor;
-                        constrcutor_name++;
-                    }
-                    if (!is_equal(constrcutor_name, structi.name_withoutns)) {
-                        // Sanity check
-                        error("Constructor / Destructor must have same name", buffer);
-                    }
-                } else {
-                    // function
-                    memberi.kind = Member_info_kind::Function;
-                }
-
-                c = buffer.skip_till_any(";{(=");
-                if (c == '=') {
-                    // We don't care about assigned values for functions
-                    // can be 0 or default or delete
-                    c = buffer.skip_till_any(";");
-                    buffer.skip(1);
-                } else {
-                    skip_function_body();
-                }
-              } else {
-                  if (c == '[') {
-                    buffer.sws_read_till(tmp, "]");
-                    memberi.count = atoi(tmp);
-                    buffer.skip(1);
-                    c = buffer.sws_get();
-                  }
-
-                  member_chain = c == ','; //new member with same type and annotations
-                  if (c == '=') {
-                    buffer.sws_read_till(memberi.default_value, ";");
-                    c = buffer.sws_get();
-                  }
-              }
-
-              if (annotation != member_annotations_t::Ignore) {
-                structi.members.push_back(memberi);
-              }
-              
-              if (member_chain) continue;
-              else break;
-          }
-
-          if (buffer.sws_peek() == '}') {
-            buffer.skip(1);
-            if (buffer.sws_get() != ';') error("Expected ';'", buffer);
-            break;
-          }
-        }
+        parse_struct_members(ctx, structi, buffer, index, tokens);
+        if (buffer.sws_get() != ';') error("Expected ';'", buffer);
       }
       c = buffer.peek();
       if (c == '\r' || c == '\n') buffer.skip_line();
@@ -435,29 +2360,42 @@ void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
       }
 
       if (buffer.test_and_skip("(")) {
-        function_info & funci = ctx.functions.emplace_back();
-        copy(funci.type, type);
-        copy(funci.name, name);
+        ir::function_info & funci = ctx.functions.emplace_back();
+        funci.type = intern(ctx, type);
+        funci.name = intern(ctx, name);
+        funci.first_parameter = (uint32_t)ctx.parameters.size();
 
         while (buffer.sws_peek() != ')')
         {
-          buffer.sws_read_till(tmp, ",)");
-          if (!is_empty(tmp)) {
-            function_parameter_info & para = funci.parameters.emplace_back();
+          if (buffer.eof) error("Expected ')'", buffer);
+
+          //[const] type [*&] name, read straight from the buffer
+          const char * p = buffer.buffer + buffer.buffer_head;
+          const char * end = p;
+          const char * limit = buffer.buffer + buffer.buffer_size;
+          while (end != limit && *end != ',' && *end != ')') ++end;
 
-            rose::StreamBuffer para_buffer;
-            para_buffer.load_mem(tmp);
+          if (p != end) {
+            ir::function_parameter_info & para = ctx.parameters.emplace_back();
+            ++funci.parameter_count;
 
-            para.is_const = para_buffer.test_and_skip("const ");
+            para.is_const = end - p >= 6 && std::memcmp(p, "const ", 6) == 0;
+            if (para.is_const) p += 6;
 
-            para_buffer.sws_read_till(para.type, "*&" WHITESPACE);
-            char c = para_buffer.sws_peek();
-            if (c == '&' || c == '*')
+            p = skip_whitespace(p, end);
+            const char * type_end = find_whitespace_or(p, end, '*', '&');
+            para.type = intern(ctx, p, type_end);
+
+            p = skip_whitespace(type_end, end);
+            if (p != end && (*p == '&' || *p == '*'))
             {
-              para.modifier = para_buffer.get();
+              para.modifier = *p++;
             }
-            para_buffer.sws_read_till(para.name, WHITESPACE);
+
+            p = skip_whitespace(p, end);
+            para.name = intern(ctx, p, find_whitespace_or(p, end, 0, 0));
           }
+          buffer.skip((int)(end - (buffer.buffer + buffer.buffer_head)));
           buffer.test_and_skip(",");
         }
         assert(buffer.peek() == ')');
@@ -465,106 +2403,775 @@ void parse(ParseContext & ctx, rose::StreamBuffer & buffer) {
         if (buffer.test_and_skip(";")) { /* empty function body */ }
         //else if (buffer.test_and_skip("{")) {
         else if (buffer.peek() == '{') {
-          skip_function_body();
+          skip_function_body(buffer, index);
         }
         else error("expected either ';' or '{'.", buffer);
       }
       else error("Expected '('", buffer);
     }
   }
+
+  if (state.final && state.last_chunk && state.conditional_depth != 0) error("missing #endif", buffer);
+  return buffer.buffer_size;
 }
 
-//printf trim trailing whitespaces
-template<typename... Args>
-void printf_ttws(const char * f, Args... args) {
-  char buffer[1024];
+void parse(ir::context & ctx, scanner & buffer) {
+  parse_state state;
+  parse(ctx, buffer, state);
+}
+
+////////////////////////////////////////////////////////
+// WORK POOL                                          //
+////////////////////////////////////////////////////////
+
+//Every thread owns a queue. It takes its own tasks newest first and steals
+//the oldest tasks of the other threads when it runs out.
+struct worker_queue {
+  std::mutex lock;
+  std::deque<std::function<void()>> tasks;
+};
+
+struct work_pool {
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::atomic<size_t> queued{0};
+  std::mutex sleep_lock;
+  std::condition_variable wake;
+};
+
+//Tasks that are waited for together.
+struct task_group {
+  std::atomic<size_t> pending{0};
+};
+
+//Never destroyed: error() may exit the process while workers are running.
+work_pool & workers = *new work_pool;
+
+//index of the queue the current thread owns, the main thread owns queue 0
+thread_local size_t worker_index = 0;
+
+size_t worker_count() {
+  return std::max<size_t>(1, workers.queues.size());
+}
+
+bool run_queued_task(size_t self) {
+  size_t n = workers.queues.size();
+  std::function<void()> task;
+  for (size_t k = 0; k != n && !task; ++k) {
+    worker_queue & q = *workers.queues[(self + k) % n];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tasks.empty()) continue;
+    if (k == 0) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    }
+    else {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+  }
+  if (!task) return false;
+  --workers.queued;
+  task();
+  return true;
+}
 
-  sprintf(buffer, f, args...);
+void worker_main(size_t self) {
+  worker_index = self;
+  for (;;) {
+    if (run_queued_task(self)) continue;
+    std::unique_lock<std::mutex> guard(workers.sleep_lock);
+    workers.wake.wait(guard, []() { return workers.queued != 0; });
+  }
+}
 
-  char * pto = buffer;
-  char * pfrom = buffer;
+//Starts threads - 1 workers, the main thread is the last one.
+void start_workers(size_t threads) {
+  threads = std::max<size_t>(1, threads);
+  for (size_t i = 0; i != threads; ++i) workers.queues.emplace_back(new worker_queue);
+  for (size_t i = 1; i != threads; ++i) std::thread(worker_main, i).detach();
+}
 
-  size_t spaces = 0;
+void run_task(task_group & group, std::function<void()> task) {
+  ++group.pending;
+  worker_queue & q = *workers.queues[worker_index];
+  {
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back([&group, task = std::move(task)]() {
+      task();
+      //group may be gone once pending is 0, don't touch it afterwards
+      if (--group.pending != 0) return;
+      std::lock_guard<std::mutex> guard(workers.sleep_lock);
+      workers.wake.notify_all();
+    });
+  }
+  ++workers.queued;
+  std::lock_guard<std::mutex> guard(workers.sleep_lock);
+  workers.wake.notify_one();
+}
 
-  RHash state = rose::hash("COPY");
+//Runs queued tasks until all tasks of the group are done. Sleeps while the
+//remaining ones run on other threads.
+void wait_tasks(task_group & group) {
+  while (group.pending) {
+    if (run_queued_task(worker_index)) continue;
+    std::unique_lock<std::mutex> guard(workers.sleep_lock);
+    workers.wake.wait(guard, [&]() { return group.pending == 0 || workers.queued != 0; });
+  }
+}
 
-  for (size_t i = 0; i != sizeof(buffer); ++i) {
-    char c = *pfrom;
-    if (c == 0) {
-      *pto = 0;
+////////////////////////////////////////////////////////
+// CHUNKS                                             //
+////////////////////////////////////////////////////////
+
+//Files smaller than this are parsed in one piece. Larger ones are split in
+//chunks of at least half this size, one per thread.
+constexpr size_t min_chunked_file_size = 512 * 1024;
+
+//A piece of a file that starts at a top level declaration, together with the
+//state parse() has at that point.
+struct parse_chunk {
+  size_t begin = 0;
+  size_t end = 0;
+  parse_state state;
+};
+
+//Offset behind the ';' that ends the declaration at offset or, if the
+//declaration isn't a struct or enum, behind the '}' of its body. Returns size
+//if the declaration doesn't end.
+size_t declaration_end(const structural_index & index, const char * data, size_t size, size_t offset, bool ends_with_semicolon) {
+  const auto & offsets = index.offsets;
+  size_t n = offsets.size();
+  int depth = 0;
+  for (size_t i = structural_find(index, offset); i < n; ++i) {
+    size_t o = offsets[i];
+    switch (data[o]) {
+    case '{':
+      ++depth;
+      break;
+    case '}':
+      if (--depth == 0 && !ends_with_semicolon) return o + 1;
       break;
+    case ';':
+      if (depth == 0) return o + 1;
+      break;
+    case '/':
+    case '"':
+    case '\'':
+      i = structural_skip_nested(index, data, i);
+      break;
+    }
+  }
+  return size;
+}
+
+//Splits the buffer at top level declarations into chunks of at least
+//chunk_size bytes. Directives and namespaces are followed the way parse()
+//does, declarations are skipped through the structural index. Chunks only end
+//behind a struct or enum, parse() has no pending annotation there.
+void find_chunks(std::vector<parse_chunk> & chunks, scanner & buffer, size_t chunk_size) {
+  structural_index index;
+  build_structural_index(index, buffer.buffer, buffer.buffer_size);
+
+  parse_state state;
+  chunks.emplace_back();
+
+  while (!buffer.eof) {
+    while (skip_comment(buffer, index)) {
     }
 
-    if (c != ' ' && state == rose::hash("COPY")) {
-      *pto = *pfrom;
-      ++pto;
-      ++pfrom;
-      continue;
+    char annotation_s[64];
+    while (buffer.test_annotation(annotation_s)) {
+      //the code in the comment following an Imposter can't be found by a scan
+      global_annotations_t annotation = decode_annotation(global_annotation_names, annotation_s, annotation_s + std::strlen(annotation_s));
+      if (annotation == global_annotations_t::Imposter) {
+        chunks.resize(1);
+        chunks[0].end = buffer.buffer_size;
+        return;
+      }
     }
-    if (c == ' ' && state == rose::hash("COPY")) {
-      spaces = 1;
-      ++pfrom;
-      state = rose::hash("SPACE");
+
+    char first = buffer.sws_peek();
+    if (first == '#') {
+      //includes are collected when the chunks are parsed
+      parse_directive(buffer, index, state, nullptr);
       continue;
     }
-    if (c == '\n' && state == rose::hash("SPACE")) {
-      *pto = '\n';
-      ++pto;
-      ++pfrom;
-      state = rose::hash("COPY");
+
+    if (first == '}') {
+      buffer.skip(1);
+      if (state.namespaces.size() == 0) error("unexpected '}'", buffer);
+      state.namespaces.pop_back();
       continue;
     }
-    if (c == ' ' && state == rose::hash("SPACE")) {
-      ++pfrom;
-      ++spaces;
+
+    keyword_t keyword = read_keyword(buffer);
+    if (keyword == keyword_t::Namespace) {
+      read_namespace(buffer, state.namespaces);
       continue;
     }
-    if (state == rose::hash("SPACE")) {
-      for (size_t s = 0; s != spaces; ++s) {
-        *(pto++) = ' ';
+
+    if (buffer.eof) break;
+    bool is_type = keyword == keyword_t::Struct || keyword == keyword_t::Enum;
+    size_t end = declaration_end(index, buffer.buffer, buffer.buffer_size, buffer.buffer_head, is_type);
+    structural_jump(buffer, end);
+
+    if (is_type && !buffer.eof && buffer.buffer_head - chunks.back().begin >= chunk_size) {
+      chunks.back().end = buffer.buffer_head;
+      parse_chunk & chunk = chunks.emplace_back();
+      chunk.begin = buffer.buffer_head;
+      chunk.state = state;
+    }
+  }
+  chunks.back().end = buffer.buffer_size;
+}
+
+//Appends the declarations of src to ctx. The strings of src are interned
+//into the pool of ctx and the handles are translated.
+void append(ir::context & ctx, ir::context & src) {
+  std::vector<string_id> ids(src.strings.strings.size());
+  for (size_t i = 0; i != ids.size(); ++i) {
+    std::string_view text = src.strings.strings[i];
+    ids[i] = intern(ctx, text.data(), text.data() + text.size());
+  }
+  auto translate = [&](string_id & id) { id = ids[id]; };
+
+  //parents are created before their children
+  std::vector<ir::namespace_id> namespace_ids(src.namespaces.size());
+  for (size_t i = 1; i < namespace_ids.size(); ++i) {
+    const ir::namespace_node & node = src.namespaces[i];
+    namespace_ids[i] = namespace_child(ctx, namespace_ids[node.parent], ids[node.name]);
+  }
+
+  ctx.enum_classes.reserve(ctx.enum_classes.size() + src.enum_classes.size());
+  ctx.enums.reserve(ctx.enums.size() + src.enums.size());
+  ctx.functions.reserve(ctx.functions.size() + src.functions.size());
+  ctx.parameters.reserve(ctx.parameters.size() + src.parameters.size());
+  ctx.structs.reserve(ctx.structs.size() + src.structs.size());
+  ctx.members.reserve(ctx.members.size() + src.members.size());
+
+  uint32_t first_file = (uint32_t)ctx.files.size();
+  for (string_id file : src.files) ctx.files.push_back(ids[file]);
+
+  uint32_t first_enum = (uint32_t)ctx.enums.size();
+  for (auto & enumi : src.enums) {
+    translate(enumi.name);
+    translate(enumi.value);
+    ctx.enums.push_back(enumi);
+  }
+  for (auto & enumci : src.enum_classes) {
+    translate(enumci.name_withns);
+    translate(enumci.name_withoutns);
+    translate(enumci.type);
+    enumci.ns = namespace_ids[enumci.ns];
+    enumci.file += first_file;
+    enumci.first_enum += first_enum;
+    translate(enumci.default_value.name);
+    translate(enumci.default_value.value);
+    ctx.enum_classes.push_back(enumci);
+  }
+
+  uint32_t first_parameter = (uint32_t)ctx.parameters.size();
+  for (auto & para : src.parameters) {
+    translate(para.name);
+    translate(para.type);
+    ctx.parameters.push_back(para);
+  }
+  for (auto & funci : src.functions) {
+    translate(funci.name);
+    translate(funci.type);
+    funci.first_parameter += first_parameter;
+    ctx.functions.push_back(funci);
+  }
+
+  uint32_t first_member = (uint32_t)ctx.members.size();
+  for (auto & member : src.members) {
+    translate(member.type);
+    translate(member.name);
+    translate(member.default_value);
+    ctx.members.push_back(member);
+  }
+  for (auto & structi : src.structs) {
+    translate(structi.name_withns);
+    translate(structi.name_withoutns);
+    structi.ns = namespace_ids[structi.ns];
+    structi.file += first_file;
+    structi.first_member += first_member;
+    ctx.structs.push_back(structi);
+  }
+
+  for (string_id include : src.includes) ctx.includes.push_back(ids[include]);
+}
+
+//Parses large files in chunks on the work pool. The results are appended to
+//ctx in source order, so ctx is the same as after parse().
+void parse_chunked(ir::context & ctx, scanner & buffer) {
+  size_t threads = worker_count();
+  if (threads == 1 || buffer.buffer_size < min_chunked_file_size) {
+    parse(ctx, buffer);
+    return;
+  }
+  size_t chunk_size = std::max(min_chunked_file_size / 2, buffer.buffer_size / threads);
+
+  std::vector<parse_chunk> chunks;
+  scanner scan;
+  scan.load_mem(buffer.buffer, buffer.buffer_size);
+  scan.path = buffer.path;
+  find_chunks(chunks, scan, chunk_size);
+  if (chunks.size() == 1) {
+    parse(ctx, buffer);
+    return;
+  }
+  for (auto & chunk : chunks) chunk.state.last_chunk = &chunk == &chunks.back();
+
+  std::vector<ir::context> results(chunks.size());
+  task_group group;
+  for (size_t i = 0; i != chunks.size(); ++i) {
+    run_task(group, [&, i]() {
+      parse_chunk & chunk = chunks[i];
+      scanner part;
+      part.load_mem(buffer.buffer + chunk.begin, chunk.end - chunk.begin);
+      part.path = buffer.path;
+      part.origin = &buffer;
+      part.origin_offset = chunk.begin;
+      parse(results[i], part, chunk.state);
+    });
+  }
+  wait_tasks(group);
+
+  for (auto & result : results) append(ctx, result);
+}
+
+//Parses a loaded input file. Files that can't contain anything to reflect are
+//skipped, unless we follow includes and the file may have some.
+void parse_input(ir::context & ctx, const char * path, const input_file & file, bool follow, bool verbose) {
+  word_counts words;
+  count_reflectable_words(words, file.data, file.size);
+  if (words.total == 0 && !(follow && std::string_view(file.data, file.size).find("include") != std::string_view::npos)) {
+    if (verbose) fprintf(stderr, "Skipping File %s (nothing to reflect)" ENDL, path);
+    return;
+  }
+  ctx.structs.reserve(ctx.structs.size() + words[reflectable_word_t::Struct]);
+  ctx.enum_classes.reserve(ctx.enum_classes.size() + words[reflectable_word_t::Enum]);
+  ctx.functions.reserve(ctx.functions.size() + words[reflectable_word_t::Operator] + words[reflectable_word_t::Serialize]);
+  scanner buffer;
+  buffer.load_mem(file.data, file.size);
+  buffer.path = path;
+  parse_chunked(ctx, buffer);
+}
+
+//The declarations of ctx refer to file 0, chunks are appended before it's added.
+void parse_file(ir::context & ctx, const char * path, bool stream, bool verbose) {
+  if (stream) {
+    parse_stream(ctx, path);
+  }
+  else {
+    input_file file;
+    if (!open_input(file, path)) {
+      fprintf(stderr, "Can't open file %s" ENDL, path);
+      exit(1);
+    }
+    parse_input(ctx, path, file, false, verbose);
+    close_input(file);
+  }
+  ctx.files.push_back(intern(ctx, path));
+}
+
+////////////////////////////////////////////////////////
+// INCLUDES                                           //
+////////////////////////////////////////////////////////
+
+//With --follow quoted #includes are resolved like a compiler does: next to the
+//including file first, then through the search paths. Every header is loaded
+//and parsed once per run, also if it's reached through different paths or is a
+//copy of a header we already have. The includes of a copy are still followed
+//from its own directory, they may name different headers there.
+struct header_info {
+  std::string path;
+  input_file file;
+  uint64_t content_hash = 0;
+  bool duplicate = false;
+  ir::context result;
+};
+
+struct header_cache {
+  std::vector<std::filesystem::path> search_paths;
+  std::deque<header_info> headers;
+  //canonical path -> header
+  std::unordered_map<std::string, size_t> paths;
+  //content hash -> header
+  std::unordered_map<uint64_t, size_t> contents;
+};
+
+//FNV-1a, can be continued with the last result
+uint64_t hash_content(const char * data, size_t size, uint64_t h = 14695981039346656037ULL) {
+  for (size_t i = 0; i != size; ++i) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//Streamed headers aren't kept in memory, they are read twice instead.
+bool hash_stream(const char * path, uint64_t & h) {
+  if (is_equal(path, "-")) return true; //stdin can't be a copy of a header
+  FILE * f = fopen(path, "rb");
+  if (!f) return false;
+  char block[64 * 1024];
+  h = hash_content(nullptr, 0);
+  for (;;) {
+    size_t read = fread(block, 1, sizeof(block), f);
+    h = hash_content(block, read, h);
+    if (read != sizeof(block)) break;
+  }
+  fclose(f);
+  return true;
+}
+
+void add_header(header_cache & cache, const std::filesystem::path & path) {
+  std::error_code ec;
+  std::filesystem::path canonical = std::filesystem::canonical(path, ec);
+  std::string key = ec ? path.string() : canonical.string();
+  if (!cache.paths.emplace(key, cache.headers.size()).second) return;
+  cache.headers.emplace_back().path = key;
+}
+
+//Returns false if the include can't be found.
+bool resolve_include(header_cache & cache, const std::string & includer, std::string_view name) {
+  std::error_code ec;
+  std::filesystem::path local = std::filesystem::path(includer).parent_path() / name;
+  if (std::filesystem::is_regular_file(local, ec)) {
+    add_header(cache, local);
+    return true;
+  }
+  for (auto & dir : cache.search_paths) {
+    std::filesystem::path found = dir / name;
+    if (std::filesystem::is_regular_file(found, ec)) {
+      add_header(cache, found);
+      return true;
+    }
+  }
+  return false;
+}
+
+//Parses the input files and every header they include, wave by wave: a wave is
+//loaded and hashed, copies are skipped and the rest is parsed on the work pool.
+//The includes of a wave make up the next one. Results are appended to ctx in
+//the order the headers were found.
+void parse_headers(ir::context & ctx, header_cache & cache, const std::vector<const char *> & files, bool stream, bool verbose) {
+  for (const char * path : files) add_header(cache, path);
+
+  size_t first = 0;
+  while (first != cache.headers.size()) {
+    size_t last = cache.headers.size();
+
+    task_group loads;
+    for (size_t i = first; i != last; ++i) {
+      run_task(loads, [&, i]() {
+        header_info & header = cache.headers[i];
+        bool ok = stream ? hash_stream(header.path.c_str(), header.content_hash) : open_input(header.file, header.path.c_str());
+        if (!ok) {
+          fprintf(stderr, "Can't open file %s" ENDL, header.path.c_str());
+          exit(1);
+        }
+        if (!stream) header.content_hash = hash_content(header.file.data, header.file.size);
+      });
+    }
+    wait_tasks(loads);
+
+    for (size_t i = first; i != last; ++i) {
+      header_info & header = cache.headers[i];
+      if (header.path == "-") continue;
+      header.duplicate = !cache.contents.emplace(header.content_hash, i).second;
+      if (!header.duplicate) continue;
+      if (verbose) fprintf(stderr, "Skipping File %s (same as %s)" ENDL, header.path.c_str(), cache.headers[cache.contents[header.content_hash]].path.c_str());
+      close_input(header.file);
+    }
+
+    task_group parses;
+    for (size_t i = first; i != last; ++i) {
+      header_info & header = cache.headers[i];
+      if (header.duplicate) continue;
+      if (verbose) fprintf(stderr, "Parsing File %s" ENDL, header.path.c_str());
+      run_task(parses, [&, i]() {
+        header_info & header = cache.headers[i];
+        if (stream) {
+          parse_stream(header.result, header.path.c_str());
+        }
+        else {
+          parse_input(header.result, header.path.c_str(), header.file, true, verbose);
+          close_input(header.file);
+        }
+        header.result.files.push_back(intern(header.result, header.path.c_str()));
+      });
+    }
+    wait_tasks(parses);
+
+    //a copy isn't parsed again, but its includes are resolved next to it
+    for (size_t i = first; i != last; ++i) {
+      header_info & header = cache.headers[i];
+      const header_info & parsed = header.duplicate ? cache.headers[cache.contents[header.content_hash]] : header;
+      for (string_id include : parsed.result.includes) {
+        std::string_view name = parsed.result.strings.strings[include];
+        if (!resolve_include(cache, header.path, name)) {
+          fprintf(stderr, "%s: can't find include \"%.*s\", skipped" ENDL, header.path.c_str(), (int)name.size(), name.data());
+        }
       }
-      *(pto++) = c;
+    }
+    first = last;
+  }
+
+  for (auto & header : cache.headers) append(ctx, header.result);
+}
+
+////////////////////////////////////////////////////////
+// EXPORT                                             //
+////////////////////////////////////////////////////////
+
+//Fills the types of parser.h, used by the JSON dump (-J) and the type hashes.
+
+template<size_t N>
+void export_string(char(&dst)[N], const ir::context & c, string_id id) {
+  std::string_view text = c.strings.strings[id];
+  copy(dst, text.data(), text.data() + text.size());
+}
+
+void export_namespaces(const ir::context & c, ir::namespace_id ns, std::vector<namespace_path> & dst) {
+  if (ns == 0) return;
+  export_namespaces(c, c.namespaces[ns].parent, dst);
+  export_string(dst.emplace_back().path, c, c.namespaces[ns].name);
+}
+
+void export_enum(const ir::context & c, const ir::enum_info & src, enum_info & dst) {
+  export_string(dst.name, c, src.name);
+  export_string(dst.value, c, src.value);
+  dst.value_type = src.value_type;
+}
+
+void export_member(const ir::context & c, const ir::member_info & src, member_info & dst) {
+  dst.kind = src.kind;
+  export_string(dst.type, c, src.type);
+  export_string(dst.name, c, src.name);
+  export_string(dst.default_value, c, src.default_value);
+  dst.count = src.count;
+  dst.annotations = src.annotations;
+}
+
+void export_struct(const ir::context & c, const ir::struct_info & src, struct_info & dst, bool fields_only) {
+  export_string(dst.name_withns, c, src.name_withns);
+  export_string(dst.name_withoutns, c, src.name_withoutns);
+  export_namespaces(c, src.ns, dst.namespaces);
+  dst.global_annotations = src.global_annotations;
+  for (auto & member : members(c, src)) {
+    if (fields_only && member.kind != Member_info_kind::Field) continue;
+    export_member(c, member, dst.members.emplace_back());
+  }
+}
+
+void export_context(const ir::context & c, ParseContext & dst) {
+  for (auto & src : c.enum_classes) {
+    enum_class_info & enumci = dst.enum_classes.emplace_back();
+    export_string(enumci.name_withns, c, src.name_withns);
+    export_string(enumci.name_withoutns, c, src.name_withoutns);
+    export_string(enumci.type, c, src.type);
+    enumci.custom_type = src.custom_type;
+    for (auto & enumi : enums(c, src)) export_enum(c, enumi, enumci.enums.emplace_back());
+    export_namespaces(c, src.ns, enumci.namespaces);
+    export_enum(c, src.default_value, enumci.default_value);
+    enumci.enum_annotations = src.enum_annotations;
+  }
+
+  for (auto & src : c.functions) {
+    function_info & funci = dst.functions.emplace_back();
+    export_string(funci.name, c, src.name);
+    export_string(funci.type, c, src.type);
+    for (auto & para : parameters(c, src)) {
+      function_parameter_info & parai = funci.parameters.emplace_back();
+      export_string(parai.name, c, para.name);
+      export_string(parai.type, c, para.type);
+      parai.modifier = para.modifier;
+      parai.is_const = para.is_const;
+    }
+  }
+
+  for (auto & src : c.structs) export_struct(c, src, dst.structs.emplace_back(), false);
+}
+
+////////////////////////////////////////////////////////
+// OUTPUT                                             //
+////////////////////////////////////////////////////////
+
+//The generated code is collected in one buffer and written at once. Types
+//are emitted into buffers of their own on the work pool, see emit_ordered().
+struct output_writer {
+  std::unique_ptr<char[]> data;
+  size_t size = 0;
+  size_t capacity = 0;
+};
+
+output_writer main_output;
+//the buffer emit() and emitf() append to on this thread
+thread_local output_writer * current_output = &main_output;
+
+void reserve_output(size_t size) {
+  output_writer & output = *current_output;
+  if (size <= output.capacity) return;
+  size_t capacity = std::max(size, std::max(output.capacity * 2, (size_t)4096));
+  std::unique_ptr<char[]> data(new char[capacity]);
+  if (output.size) std::memcpy(data.get(), output.data.get(), output.size);
+  output.data = std::move(data);
+  output.capacity = capacity;
+}
+
+inline void emit(const char * text, size_t length) {
+  output_writer & output = *current_output;
+  reserve_output(output.size + length);
+  std::memcpy(output.data.get() + output.size, text, length);
+  output.size += length;
+}
+
+//Appends text as it is. The templates have no trailing whitespace.
+inline void emit(const char * text) {
+  emit(text, std::strlen(text));
+}
+
+//Appends formatted text, the result is not trimmed either.
+template<typename... Args>
+void emitf(const char * format, Args... args) {
+  output_writer & output = *current_output;
+  reserve_output(output.size + 256);
+  size_t begin = output.size;
+  size_t available = output.capacity - begin;
+  size_t length = (size_t)snprintf(output.data.get() + begin, available, format, args...);
+  if (length >= available) {
+    reserve_output(begin + length + 1);
+    snprintf(output.data.get() + begin, length + 1, format, args...);
+  }
+  output.size = begin + length;
+}
+
+//Runs fn(0) .. fn(count - 1) on the work pool. The calls are split into a few
+//batches per thread, each batch emits into a buffer of its own. The buffers
+//are appended in order, so the output is the same as running them one after
+//the other.
+template<class F>
+void emit_ordered(size_t count, F fn) {
+  size_t threads = worker_count();
+  if (threads == 1 || count < 2) {
+    for (size_t i = 0; i != count; ++i) fn(i);
+    return;
+  }
+
+  size_t batches = std::min(count, threads * 8);
+  std::vector<output_writer> parts(batches);
+  task_group group;
+  for (size_t b = 0; b != batches; ++b) {
+    run_task(group, [&, b]() {
+      output_writer * saved = current_output;
+      current_output = &parts[b];
+      for (size_t i = count * b / batches; i != count * (b + 1) / batches; ++i) fn(i);
+      current_output = saved;
+    });
+  }
+  wait_tasks(group);
+
+  size_t size = current_output->size;
+  for (auto & part : parts) size += part.size;
+  reserve_output(size);
+  for (auto & part : parts) {
+    if (part.size) emit(part.data.get(), part.size);
+    part = output_writer();
+  }
+}
 
-      ++pfrom;
-      state = rose::hash("COPY");
-      continue;
+void write_output(output_writer & output, FILE * f) {
+  fwrite(output.data.get(), 1, output.size, f);
+  output.size = 0;
+}
+
+//Replaces to with from. Both must be on the same volume.
+bool replace_file(const char * from, const char * to) {
+#ifdef _WIN32
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(from, to) == 0;
+#endif
+}
+
+//Writes the output to path. A file that already has the same content is left
+//untouched, so its mtime doesn't trigger rebuilds. Otherwise the output goes
+//to a temporary file next to path, which then replaces it in one step.
+bool write_output_file(output_writer & output, const char * path, bool verbose) {
+  input_file existing;
+  if (open_input(existing, path)) {
+    bool same = existing.size == output.size && (existing.size == 0 || std::memcmp(existing.data, output.data.get(), existing.size) == 0);
+    close_input(existing);
+    if (same) {
+      if (verbose) fprintf(stderr, "Skipping Output %s (unchanged)" ENDL, path);
+      output.size = 0;
+      return true;
     }
   }
-  fputs(buffer, stdout);
+
+#ifdef _WIN32
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = (unsigned long)getpid();
+#endif
+  std::string tmp_path = std::string(path) + "." + std::to_string(pid) + ".tmp";
+  FILE * f = fopen(tmp_path.c_str(), "wb");
+  if (!f) return false;
+  write_output(output, f);
+  bool ok = fflush(f) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = replace_file(tmp_path.c_str(), path);
+  if (!ok) remove(tmp_path.c_str());
+  return ok;
+}
+
+//The free functions has_compare_ops() looks for, keyed by
+//(function name << 32 | first parameter type). Only functions with two
+//parameters are indexed, comparison operators only if both have the same type.
+struct function_index {
+  string_id eqop = no_string;
+  string_id neqop = no_string;
+  string_id serialize = no_string;
+  string_id deserialize = no_string;
+  std::unordered_set<uint64_t> functions;
+};
+
+inline uint64_t function_key(string_id name, string_id type) {
+  return (uint64_t)name << 32 | type;
 }
 
-void has_compare_ops(bool & has_eqop, bool & has_neqop, bool & has_serialize, bool & has_deserialize, ParseContext & c, const char * sname) {
-  RHash shash = rose::hash(sname);
-  has_eqop = false;
-  has_neqop = false;
-  has_serialize = false;
-  has_deserialize = false;
+void build_function_index(function_index & index, const ir::context & c) {
+  index.eqop = find_string(c.strings, "operator==");
+  index.neqop = find_string(c.strings, "operator!=");
+  index.serialize = find_string(c.strings, "serialize");
+  index.deserialize = find_string(c.strings, "deserialize");
+  index.functions.clear();
 
   for (auto & inf : c.functions) {
-    if (inf.parameters.size() == 2 &&
-      rose::hash(inf.name) == rose::hash("operator==") &&
-      rose::hash(inf.parameters[0].type) == shash &&
-      rose::hash(inf.parameters[1].type) == shash)
-      has_eqop = true;
-
-    if (inf.parameters.size() == 2 &&
-      rose::hash(inf.name) == rose::hash("operator!=") &&
-      rose::hash(inf.parameters[0].type) == shash &&
-      rose::hash(inf.parameters[1].type) == shash)
-      has_neqop = true;
+    auto params = parameters(c, inf);
+    if (params.size() != 2) continue;
+    bool is_compare = inf.name == index.eqop || inf.name == index.neqop;
+    bool is_serialize = inf.name == index.serialize || inf.name == index.deserialize;
+    if (is_compare && params[0].type != params[1].type) continue;
+    if (is_compare || is_serialize) index.functions.insert(function_key(inf.name, params[0].type));
+  }
+}
 
-    if (inf.parameters.size() == 2 &&
-      rose::hash(inf.name) == rose::hash("serialize") &&
-      rose::hash(inf.parameters[0].type) == shash)
-      has_serialize = true;
+inline bool has_function(const function_index & index, string_id name, string_id type) {
+  return name != no_string && index.functions.count(function_key(name, type)) != 0;
+}
 
-    if (inf.parameters.size() == 2 &&
-      rose::hash(inf.name) == rose::hash("deserialize") &&
-      rose::hash(inf.parameters[0].type) == shash)
-      has_deserialize = true;
-  }
+void has_compare_ops(bool & has_eqop, bool & has_neqop, bool & has_serialize, bool & has_deserialize, const function_index & index, const ir::context & c, const ir::struct_info & structi) {
+  const char * sname = str(c, structi.name_withns);
+  string_id sid = structi.name_withns;
+  has_eqop = has_function(index, index.eqop, sid);
+  has_neqop = has_function(index, index.neqop, sid);
+  has_serialize = has_function(index, index.serialize, sid);
+  has_deserialize = has_function(index, index.deserialize, sid);
 
-  
   int number_of_eq_ops = 0;
   if (has_eqop)
     ++number_of_eq_ops;
@@ -577,114 +3184,348 @@ void has_compare_ops(bool & has_eqop, bool & has_neqop, bool & has_serialize, bo
   }
 }
 
-RHash filtered_struct_hash(struct_info structi) {
-  auto struct_no_functions = structi;
-  auto new_end = std::stable_partition(
-    struct_no_functions.members.begin(), struct_no_functions.members.end(),
-    [](const auto & member) {
-        return member.kind == Member_info_kind::Field;
-    });
-  struct_no_functions.members.erase(new_end, struct_no_functions.members.end());
-  return rose::hash(struct_no_functions);
-}
-
-void dump_cpp(ParseContext & c, int argc = 0, char ** argv = nullptr) {
-  printf_ttws("#pragma once" ENDL);
-  printf_ttws("" ENDL);
-  printf_ttws("#include <new>" ENDL);
-  printf_ttws("#include <rose/hash.h>" ENDL);
-  printf_ttws("#include <rose/typetraits.h>" ENDL);
-  printf_ttws("#include <rose/serializer.h>" ENDL);
-  printf_ttws("#include <rose/world.h>" ENDL);
-  printf_ttws("" ENDL);
-  printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-  printf_ttws("//  AUTOGEN                                                        " ENDL);
-  if (argc && argv) {
-    printf_ttws("//  command:" ENDL);
-    printf_ttws("//    rose.parser");
-    for (int i = 1; i < argc; ++i) {
-      printf_ttws(" %s", argv[i]);
-    }
-    printf_ttws("" ENDL);
+////////////////////////////////////////////////////////
+// FINGERPRINTS                                       //
+////////////////////////////////////////////////////////
+
+//The fingerprint of a struct covers its fields and, through the types of its
+//fields, every struct and enum class it contains. The local part equals
+//rose::hash() of the exported struct_info without its functions, but is
+//computed one member at a time.
+
+RHash namespaces_fingerprint(const ir::context & c, ir::namespace_id ns) {
+  if (ns == 0) return 0;
+  RHash h = namespaces_fingerprint(c, c.namespaces[ns].parent);
+  namespace_path path = {};
+  export_string(path.path, c, c.namespaces[ns].name);
+  h ^= rose::hash(path);
+  return rose::xor64(h);
+}
+
+RHash local_fingerprint(const ir::context & c, const ir::struct_info & structi) {
+  char name_withns[64] = "";
+  char name_withoutns[64] = "";
+  export_string(name_withns, c, structi.name_withns);
+  export_string(name_withoutns, c, structi.name_withoutns);
+
+  RHash fields = 0;
+  for (auto & member : members(c, structi)) {
+    if (member.kind != Member_info_kind::Field) continue;
+    member_info memberi = {};
+    export_member(c, member, memberi);
+    fields ^= rose::hash(memberi);
+    fields = rose::xor64(fields);
   }
-  printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
 
-  // deump definition
-  
-  for (auto & enumci : c.enum_classes) {
-    const char * ename = enumci.name_withns;
-    const char * etype = enumci.type;
-    
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-    printf_ttws("//  predef enum %s" ENDL, ename);
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-    if (enumci.enum_annotations == global_annotations_t::Flag) {
-        puts("");
-        printf_ttws("inline rose::BoolConvertible<%s> operator|(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) | static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
-        printf_ttws("inline rose::BoolConvertible<%s> operator&(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) & static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
-        printf_ttws("inline rose::BoolConvertible<%s> operator^(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) ^ static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
-        printf_ttws("inline %s operator|=(%s & lhs, %s rhs) { return lhs = lhs | rhs; }                                                    " ENDL, ename, ename, ename);
-        printf_ttws("inline %s operator&=(%s & lhs, %s rhs) { return lhs = lhs & rhs; }                                                    " ENDL, ename, ename, ename);
-        printf_ttws("inline %s operator^=(%s & lhs, %s rhs) { return lhs = lhs ^ rhs; }                                                    " ENDL, ename, ename, ename);
-    }
+  RHash h = 0;
+  h ^= rose::rose_parser_hash(name_withns);
+  h = rose::xor64(h);
+  h ^= rose::rose_parser_hash(name_withoutns);
+  h = rose::xor64(h);
+  h ^= namespaces_fingerprint(c, structi.ns);
+  h = rose::xor64(h);
+  h ^= rose::rose_parser_hash(structi.global_annotations);
+  h = rose::xor64(h);
+  h ^= fields;
+  return h;
+}
+
+RHash enum_fingerprint(const ir::context & c, const ir::enum_class_info & enumci) {
+  RHash h = rose::hash(c_str(c.strings, enumci.name_withns));
+  for (auto & enumi : enums(c, enumci)) {
+    enum_info exported = {};
+    export_enum(c, enumi, exported);
+    h ^= rose::hash(exported);
+    h = rose::xor64(h);
+  }
+  return h;
+}
+
+//Type name -> struct or enum class. Enum classes are stored as ~index, so
+//values >= structs.size() are enum classes.
+struct type_graph {
+  std::unordered_map<string_id, size_t> types;
+};
 
+void build_type_graph(type_graph & graph, const ir::context & c) {
+  graph.types.clear();
+  for (size_t i = 0; i != c.enum_classes.size(); ++i) graph.types[c.enum_classes[i].name_withns] = ~i;
+  for (size_t i = 0; i != c.structs.size(); ++i) graph.types[c.structs[i].name_withns] = i;
+}
+
+//Finds the struct or enum class a name in a field type refers to. Like C++
+//the name is looked up in the namespace of the struct first, then outwards.
+bool resolve_type(const ir::context & c, const type_graph & graph, ir::namespace_id ns, std::string_view name, size_t & type) {
+  for (;;) {
+    std::string qualified = c_str(c.strings, c.namespaces[ns].prefix);
+    qualified.append(name.data(), name.size());
+    string_id id = find_string(c.strings, qualified.c_str());
+    auto it = id == no_string ? graph.types.end() : graph.types.find(id);
+    if (it != graph.types.end()) {
+      type = it->second;
+      return true;
+    }
+    if (ns == 0) return false;
+    ns = c.namespaces[ns].parent;
+  }
+}
 
-    printf_ttws("namespace rose {" ENDL);
-    printf_ttws("inline const char * to_string(const %s & e);" ENDL, ename);
-    printf_ttws("inline void serialize(%s& o, ISerializer& s); " ENDL, ename);
-    printf_ttws("inline void deserialize(%s& o, IDeserializer& s); " ENDL, ename);
-    printf_ttws("inline RHash       hash(const %s& o); " ENDL, ename);
-    printf_ttws("} //namespace rose \n" ENDL);
+//Calls fn with every struct or enum class named in the field types of
+//structi, e.g. both in std::map<ns::key, value>.
+template<class F>
+void for_each_field_type(const ir::context & c, const type_graph & graph, const ir::struct_info & structi, F fn) {
+  for (auto & member : members(c, structi)) {
+    if (member.kind != Member_info_kind::Field) continue;
+    std::string_view type = c.strings.strings[member.type];
+    for (size_t i = 0; i != type.size();) {
+      if (!is_identifier_char(type[i])) {
+        ++i;
+        continue;
+      }
+      size_t begin = i;
+      while (i != type.size() && (is_identifier_char(type[i]) || (type[i] == ':' && i + 1 != type.size() && type[i + 1] == ':'))) {
+        i += type[i] == ':' ? 2 : 1;
+      }
+      size_t found;
+      if (resolve_type(c, graph, structi.ns, type.substr(begin, i - begin), found)) fn(found);
+    }
   }
+}
 
-  for (auto & structi : c.structs) {
-    const char * sname = structi.name_withns;
-    //const char * sname_nons = structi.name_withoutns;
+struct fingerprint_pass {
+  ir::context * c;
+  type_graph graph;
+  //0 = not visited, 1 = in progress, 2 = done
+  std::vector<unsigned char> state;
+};
+
+RHash struct_fingerprint(fingerprint_pass & pass, size_t index) {
+  ir::context & c = *pass.c;
+  ir::struct_info & structi = c.structs[index];
+  //a cycle through pointers or containers ends at the local fingerprint
+  if (pass.state[index] == 1) return local_fingerprint(c, structi);
+  if (pass.state[index] == 2) return structi.fingerprint;
+  pass.state[index] = 1;
+
+  RHash h = local_fingerprint(c, structi);
+  for_each_field_type(c, pass.graph, structi, [&](size_t type) {
+    if (type < c.structs.size()) h ^= struct_fingerprint(pass, type);
+    else h ^= enum_fingerprint(c, c.enum_classes[~type]);
+    h = rose::xor64(h);
+  });
+
+  structi.fingerprint = h;
+  pass.state[index] = 2;
+  return h;
+}
 
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-    printf_ttws("//  predef struct %s" ENDL, sname);
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
+//Computes the fingerprint of every struct once, dependencies first.
+void fingerprint_types(ir::context & c, const type_graph & graph) {
+  fingerprint_pass pass;
+  pass.c = &c;
+  pass.graph = graph;
+  pass.state.assign(c.structs.size(), 0);
+  for (size_t i = 0; i != c.structs.size(); ++i) struct_fingerprint(pass, i);
+}
 
-    printf_ttws("namespace rose {" ENDL);
+////////////////////////////////////////////////////////
+// ROOTS                                              //
+////////////////////////////////////////////////////////
 
-    bool has_eqop = false;
-    bool has_neqop = false;
-    bool has_serialize = false;
-    bool has_deserialize = false;
-    has_compare_ops(has_eqop, has_neqop, has_serialize, has_deserialize, c, sname);
+//Names given with --roots
+std::vector<std::string> root_names;
 
-    if (!has_eqop) {
-      printf_ttws("inline bool equals(const %s &lhs, const %s &rhs);" ENDL, sname, sname);
-      printf_ttws("inline bool operator==(const %s &lhs, const %s &rhs) { return equals(lhs, rhs); }" ENDL, sname, sname);
-      printf_ttws("inline bool operator!=(const %s &lhs, const %s &rhs) { return !equals(lhs, rhs); }" ENDL, sname, sname);
+//If there are roots (--roots or //@Root), only the structs and enum classes
+//reachable from them through field types are emitted.
+void prune_types(ir::context & c, const type_graph & graph) {
+  std::vector<size_t> pending;
+  for (size_t i = 0; i != c.structs.size(); ++i) {
+    if (c.structs[i].root) pending.push_back(i);
+  }
+  for (size_t i = 0; i != c.enum_classes.size(); ++i) {
+    if (c.enum_classes[i].root) pending.push_back(~i);
+  }
+  for (auto & name : root_names) {
+    size_t type;
+    if (!resolve_type(c, graph, 0, name, type)) {
+      fprintf(stderr, "Unknown root type %s" ENDL, name.c_str());
+      exit(1);
     }
-
-    if (!has_serialize) {
-      printf_ttws("inline void serialize(%s &o, ISerializer &s);                   " ENDL, sname);
+    pending.push_back(type);
+  }
+  if (pending.empty()) return;
+
+  for (auto & structi : c.structs) structi.emit = false;
+  for (auto & enumci : c.enum_classes) enumci.emit = false;
+  while (!pending.empty()) {
+    size_t type = pending.back();
+    pending.pop_back();
+    if (type >= c.structs.size()) {
+      c.enum_classes[~type].emit = true;
+      continue;
     }
+    ir::struct_info & structi = c.structs[type];
+    if (structi.emit) continue;
+    structi.emit = true;
+    for_each_field_type(c, graph, structi, [&](size_t dependency) { pending.push_back(dependency); });
+  }
+}
+
+//How the predefs and impls are spread over the generated files.
+enum class layout_t {
+  Header = 0, //one header, everything is inline
+  Shards,     //--shard-by, the impls go to headers of their own
+  Split       //--impl, the impls are out of line in a .cpp
+};
+
+//"inline " for functions defined in headers
+inline const char * inline_keyword(layout_t layout) {
+  return layout == layout_t::Split ? "" : "inline ";
+}
 
-    if (!has_deserialize) {
-      printf_ttws("inline void deserialize(%s &o, IDeserializer &s);  " ENDL, sname);
+//The command line is part of the output, so options that don't change the
+//generated code (-V, -S, -j, --datetime) are left out and the defines are
+//sorted by name. Changing them doesn't rewrite unchanged outputs then.
+void emit_command(int argc, char ** argv) {
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  emit("//  AUTOGEN" ENDL);
+  if (argc && argv) {
+    emit("//  command:" ENDL);
+    emit("//    rose.parser");
+    std::vector<std::string_view> defines;
+    for (int i = 1; i < argc; ++i) {
+      const char * arg = argv[i];
+      RHash h = rose::hash(arg);
+      if (h == rose::hash("--verbose") || h == rose::hash("-V")) continue;
+      if (h == rose::hash("--stream") || h == rose::hash("-S")) continue;
+      if (h == rose::hash("--datetime")) continue;
+      if (h == rose::hash("--jobs") || h == rose::hash("-j")) {
+        ++i;
+        continue;
+      }
+      if (arg[0] == '-' && arg[1] == 'j' && arg[2] >= '0' && arg[2] <= '9') continue;
+      if (h == rose::hash("--define") || h == rose::hash("-D")) {
+        if (++i != argc) defines.push_back(argv[i]);
+        continue;
+      }
+      if (arg[0] == '-' && arg[1] == 'D' && arg[2] != 0) {
+        defines.push_back(arg + 2);
+        continue;
+      }
+      emitf(" %s", arg);
     }
-    printf_ttws("inline RHash hash(const %s &o);" ENDL, sname);
-    puts("");
+    //a later define of the same name wins, so their order is kept
+    auto define_name = [](std::string_view define) { return define.substr(0, define.find('=')); };
+    std::stable_sort(defines.begin(), defines.end(), [&](std::string_view a, std::string_view b) { return define_name(a) < define_name(b); });
+    for (std::string_view define : defines) emitf(" -D%.*s", (int)define.size(), define.data());
+    emit(ENDL);
+  }
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+}
 
-    ///////////////////////////////////////////////////////////////////
-    // type info                                                     //
-    ///////////////////////////////////////////////////////////////////
+void emit_prologue(int argc, char ** argv) {
+  emit("#pragma once" ENDL);
+  emit(ENDL);
+  emit("#include <new>" ENDL);
+  emit("#include <rose/hash.h>" ENDL);
+  emit("#include <rose/typetraits.h>" ENDL);
+  emit("#include <rose/serializer.h>" ENDL);
+  emit("#include <rose/world.h>" ENDL);
+  emit(ENDL);
+  emit_command(argc, argv);
+}
+
+void emit_enum_predef(const ir::context & c, const ir::enum_class_info & enumci, layout_t layout) {
+  const char * ename = str(c, enumci.name_withns);
+  const char * etype = str(c, enumci.type);
+  const char * inl = inline_keyword(layout);
+  
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  emitf("//  predef enum %s" ENDL, ename);
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  if (enumci.enum_annotations == global_annotations_t::Flag) {
+      emit(ENDL);
+      emitf("inline rose::BoolConvertible<%s> operator|(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) | static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
+      emitf("inline rose::BoolConvertible<%s> operator&(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) & static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
+      emitf("inline rose::BoolConvertible<%s> operator^(const %s &lhs, const %s &rhs) { return { static_cast<%s>(static_cast<%s>(lhs) ^ static_cast<%s>(rhs)) }; }" ENDL, ename, ename, ename, ename, etype, etype);
+      emitf("inline %s operator|=(%s & lhs, %s rhs) { return lhs = lhs | rhs; }" ENDL, ename, ename, ename);
+      emitf("inline %s operator&=(%s & lhs, %s rhs) { return lhs = lhs & rhs; }" ENDL, ename, ename, ename);
+      emitf("inline %s operator^=(%s & lhs, %s rhs) { return lhs = lhs ^ rhs; }" ENDL, ename, ename, ename);
+  }
+
+
+  emit("namespace rose {" ENDL);
+  emitf("%sconst char * to_string(const %s & e);" ENDL, inl, ename);
+  emitf("%svoid serialize(%s& o, ISerializer& s);" ENDL, inl, ename);
+  emitf("%svoid deserialize(%s& o, IDeserializer& s);" ENDL, inl, ename);
+  emitf("%sRHash       hash(const %s& o);" ENDL, inl, ename);
+  emit("} //namespace rose\n" ENDL);
+}
+
+//Shards only declare the operators here, they are defined with the impls.
+//Out of line type_id<>::VALUE is only declared, so the header doesn't change
+//with the fields.
+void emit_struct_predef(const ir::context & c, const function_index & functions, const ir::struct_info & structi, layout_t layout) {
+  const char * sname = str(c, structi.name_withns);
+  const char * inl = inline_keyword(layout);
+  //const char * sname_nons = str(c, structi.name_withoutns);
+
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  emitf("//  predef struct %s" ENDL, sname);
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+
+  emit("namespace rose {" ENDL);
+
+  bool has_eqop = false;
+  bool has_neqop = false;
+  bool has_serialize = false;
+  bool has_deserialize = false;
+  has_compare_ops(has_eqop, has_neqop, has_serialize, has_deserialize, functions, c, structi);
+
+  if (!has_eqop) {
+    emitf("%sbool equals(const %s &lhs, const %s &rhs);" ENDL, inl, sname, sname);
+    if (layout == layout_t::Shards) {
+      emitf("inline bool operator==(const %s &lhs, const %s &rhs);" ENDL, sname, sname);
+      emitf("inline bool operator!=(const %s &lhs, const %s &rhs);" ENDL, sname, sname);
+    }
+    else {
+      emitf("inline bool operator==(const %s &lhs, const %s &rhs) { return equals(lhs, rhs); }" ENDL, sname, sname);
+      emitf("inline bool operator!=(const %s &lhs, const %s &rhs) { return !equals(lhs, rhs); }" ENDL, sname, sname);
+    }
+  }
 
-    printf_ttws("template <>                                                                                                                                    " ENDL);
-    printf_ttws("struct type_id<%s>; " ENDL, sname);
+  if (!has_serialize) {
+    emitf("%svoid serialize(%s &o, ISerializer &s);" ENDL, inl, sname);
+  }
 
-    printf_ttws("template <>                                                                                                                                    " ENDL);
-    printf_ttws("inline const reflection::TypeInfo & reflection::get_type_info<%s>(); " ENDL, sname);
-    printf_ttws("} //namespace rose \n" ENDL);
-    puts("");
+  if (!has_deserialize) {
+    emitf("%svoid deserialize(%s &o, IDeserializer &s);" ENDL, inl, sname);
+  }
+  emitf("%sRHash hash(const %s &o);" ENDL, inl, sname);
+  emit(ENDL);
+
+  ///////////////////////////////////////////////////////////////////
+  // type info                                                     //
+  ///////////////////////////////////////////////////////////////////
+
+  emit("template <>" ENDL);
+  if (layout == layout_t::Split) {
+    emitf("struct type_id<%s> {" ENDL, sname);
+    emit("    static RHash VALUE;" ENDL);
+    emit("};" ENDL);
+  }
+  else {
+    emitf("struct type_id<%s>;" ENDL, sname);
   }
 
-  // dump implementation
+  emit("template <>" ENDL);
+  emitf("%sconst reflection::TypeInfo & reflection::get_type_info<%s>();" ENDL, inl, sname);
+  emit("} //namespace rose\n" ENDL);
+  emit(ENDL);
+}
 
-  puts(R"MLS(
+void emit_impl_helpers() {
+  emit(R"MLS(
 #ifndef IMPL_SERIALIZER_UTIL
 #define IMPL_SERIALIZER_UTIL
 
@@ -739,219 +3580,492 @@ RHash rose_parser_hash(const std::vector<T>& v) {
 
 }
 #endif
-  )MLS");
+  )MLS" ENDL);
+}
 
-  for (auto & enumci : c.enum_classes) {
-    const char * ename = enumci.name_withns;
-    
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-    printf_ttws("//  impl enum %s" ENDL, ename);
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
+void emit_enum_impl(const ir::context & c, const ir::enum_class_info & enumci, layout_t layout) {
+  const char * ename = str(c, enumci.name_withns);
+  const char * inl = inline_keyword(layout);
+  
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  emitf("//  impl enum %s" ENDL, ename);
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+
+  //to_string() of dense enums looks the name up by value - min_value, the rest
+  //are switches. Aliases in folded enums get no case of their own.
+  auto values = enums(c, enumci);
+  std::vector<bool> alias(values.size());
+  if (enumci.folded) {
+    std::unordered_set<long long> numbers;
+    for (uint32_t i = 0; i != values.size(); ++i) alias[i] = !numbers.insert(values[i].number).second;
+  }
 
-    printf_ttws("inline const char * rose::to_string(const %s & e) {" ENDL, ename);
-    printf_ttws("    switch(e) {" ENDL);
-    for (auto & enumi : enumci.enums) {
-      const char * eval = enumi.name;
-      printf_ttws("        case %s::%s: return \"%s\";" ENDL, ename, eval, eval);
+  emitf("%sconst char * rose::to_string(const %s & e) {" ENDL, inl, ename);
+  if (enumci.dense) {
+    std::vector<uint32_t> order(values.size());
+    for (uint32_t i = 0; i != order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return values[a].number < values[b].number; });
+    emit("  static const char * const names[] = {" ENDL);
+    for (uint32_t i : order) emitf("    \"%s\"," ENDL, str(c, values[i].name));
+    emit("  };" ENDL);
+    emitf("  long long i = static_cast<long long>(e) - (%lldLL);" ENDL, enumci.min_value);
+    emitf("  return i >= 0 && i < %u ? names[i] : \"<UNKNOWN>\";" ENDL, (unsigned)values.size());
+  }
+  else {
+    emit("  switch (e) {" ENDL);
+    for (uint32_t i = 0; i != values.size(); ++i) {
+      if (alias[i]) continue;
+      const char * eval = str(c, values[i].name);
+      emitf("    case %s::%s: return \"%s\";" ENDL, ename, eval, eval);
     }
-    printf_ttws("        default: return \"<UNKNOWN>\";" ENDL);
-    printf_ttws("    }" ENDL);
-    printf_ttws("}" ENDL);
+    emit("    default: return \"<UNKNOWN>\";" ENDL);
+    emit("  }" ENDL);
+  }
+  emit("}" ENDL);
 
 
-    printf_ttws("inline void rose::serialize(%s& o, ISerializer& s) {                  " ENDL, ename);
-    printf_ttws("  switch (o) {                                                      " ENDL);
+  emitf("%svoid rose::serialize(%s& o, ISerializer& s) {" ENDL, inl, ename);
+  emit("  switch (o) {" ENDL);
 
-    for (auto & enumi : enumci.enums) {
-      const char * eval = enumi.name;
-      printf_ttws("    case %s::%s: {                                                " ENDL, ename, eval);
-      printf_ttws("      char str[] = \"%s\";                                        " ENDL, eval);
-      printf_ttws("      serialize(str, s);                                          " ENDL);
-      printf_ttws("      break;                                                      " ENDL);
-      printf_ttws("    }                                                             " ENDL);
-    }
+  for (uint32_t i = 0; i != values.size(); ++i) {
+    if (alias[i]) continue;
+    const char * eval = str(c, values[i].name);
+    emitf("    case %s::%s: {" ENDL, ename, eval);
+    emitf("      char str[] = \"%s\";" ENDL, eval);
+    emit("      serialize(str, s);" ENDL);
+    emit("      break;" ENDL);
+    emit("    }" ENDL);
+  }
+
+  emit("    default: /* unknown */ break;" ENDL);
+  emit("  }" ENDL);
+  emit("}" ENDL);
+
+  emitf("%svoid rose::deserialize(%s& o, IDeserializer& s) {" ENDL, inl, ename);
+  emit("  char str[64];" ENDL);
+  emit("  deserialize(str, s);" ENDL);
+  emit("  RHash h = rose::hash(str);" ENDL);
+  emit("  switch (h) {" ENDL);
+  for (auto & enumi : values) {
+    const char * eval = str(c, enumi.name);
+    emitf("    case rose::hash(\"%s\"): o = %s::%s; break;" ENDL, eval, ename, eval);
+  }
+  emit("    default: /*unknown value*/ break;" ENDL);
+  emit("  }" ENDL);
+  emit("}" ENDL);
 
-    printf_ttws("    default: /* unknown */ break;                                   " ENDL);
-    printf_ttws("  }                                                                 " ENDL);
-    printf_ttws("}                                                                   " ENDL);
+  emitf("%sRHash rose::hash(const %s& o) {" ENDL, inl, ename);
+  emit("  return static_cast<RHash>(o);" ENDL);
+  emit("}\n" ENDL);
+}
 
-    printf_ttws("inline void rose::deserialize(%s& o, IDeserializer& s) {            " ENDL, ename);
-    printf_ttws("  char str[64];                                                     " ENDL);
-    printf_ttws("  deserialize(str, s);                                              " ENDL);
-    printf_ttws("  RHash h = rose::hash(str);                             " ENDL);
-    printf_ttws("  switch (h) {                                                      " ENDL);
-    for (auto & enumi : enumci.enums) {
-      const char * eval = enumi.name;
-      printf_ttws("  case rose::hash(\"%s\"): o = %s::%s; break;                     " ENDL, eval, ename, eval);
-    }
-    printf_ttws("  default: /*unknown value*/ break;                                 " ENDL);
-    printf_ttws("  }                                                                 " ENDL);
-    printf_ttws("}                                                                   " ENDL);
+void emit_struct_impl(const ir::context & c, const function_index & functions, string_id char_type, const ir::struct_info & structi, layout_t layout) {
+  const char * sname = str(c, structi.name_withns);
+  const char * sname_nons = str(c, structi.name_withoutns);
+  const char * inl = inline_keyword(layout);
 
-    printf_ttws("inline RHash rose::hash(const %s& o) {          " ENDL, ename);
-    printf_ttws("  return static_cast<RHash>(o);                 " ENDL);
-    printf_ttws("}                                                  \n" ENDL);
-  }
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
+  emitf("//  impl struct %s" ENDL, sname);
+  emit("///////////////////////////////////////////////////////////////////" ENDL);
 
-  for (auto & structi : c.structs) {
-    const char * sname = structi.name_withns;
-    const char * sname_nons = structi.name_withoutns;
+  ///////////////////////////////////////////////////////////////////
+  // == and != operator                                            //
+  ///////////////////////////////////////////////////////////////////
 
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
-    printf_ttws("//  impl struct %s" ENDL, sname);
-    printf_ttws("///////////////////////////////////////////////////////////////////" ENDL);
+  bool has_eqop = false;
+  bool has_neqop = false;
+  bool has_serialize = false;
+  bool has_deserialize = false;
+  has_compare_ops(has_eqop, has_neqop, has_serialize, has_deserialize, functions, c, structi);
 
-    ///////////////////////////////////////////////////////////////////
-    // == and != operator                                            //
-    ///////////////////////////////////////////////////////////////////
+  if (!has_eqop) {
+    emitf("%sbool rose::equals(const %s &lhs, const %s &rhs) {" ENDL, inl, sname, sname);
+    emit("  return" ENDL);
+    bool first = true;
+    for (auto & member : members(c, structi)) {
+      if (member.kind != Member_info_kind::Field)
+        continue;
 
-    bool has_eqop = false;
-    bool has_neqop = false;
-    bool has_serialize = false;
-    bool has_deserialize = false;
-    has_compare_ops(has_eqop, has_neqop, has_serialize, has_deserialize, c, sname);
-
-    if (!has_eqop) {
-      printf_ttws("inline bool rose::equals(const %s &lhs, const %s &rhs) {" ENDL, sname, sname);
-      fputs("  return" ENDL, stdout);
-      bool first = true;
-      for (auto & member : structi.members) {
-        if (member.kind != Member_info_kind::Field)
-          continue;
-
-        if (first) {
-          first = false;
-        } else  {
-          printf_ttws(" &&" ENDL, stdout);
-        }
-        printf_ttws("    rose::rose_parser_equals(lhs.%s, rhs.%s)", member.name, member.name);
+      if (first) {
+        first = false;
+      } else  {
+        emit(" &&" ENDL);
       }
-      printf_ttws(";" ENDL "} " ENDL ENDL);
+      emitf("    rose::rose_parser_equals(lhs.%s, rhs.%s)", str(c, member.name), str(c, member.name));
     }
+    emit(";" ENDL "}" ENDL ENDL);
+    if (layout == layout_t::Shards) {
+      emitf("inline bool rose::operator==(const %s &lhs, const %s &rhs) { return equals(lhs, rhs); }" ENDL, sname, sname);
+      emitf("inline bool rose::operator!=(const %s &lhs, const %s &rhs) { return !equals(lhs, rhs); }" ENDL ENDL, sname, sname);
+    }
+  }
 
 
 
-    if (!has_serialize) {
-      ///////////////////////////////////////////////////////////////////
-      // serializer                                                    //
-      ///////////////////////////////////////////////////////////////////
-      printf_ttws("inline void rose::serialize(%s &o, ISerializer &s) {                     " ENDL, sname);
-      printf_ttws("  if(s.node_begin(\"%s\", hash(\"%s\"), &o)) {               " ENDL, sname, sname);
+  if (!has_serialize) {
+    ///////////////////////////////////////////////////////////////////
+    // serializer                                                    //
+    ///////////////////////////////////////////////////////////////////
+    emitf("%svoid rose::serialize(%s &o, ISerializer &s) {" ENDL, inl, sname);
+    emitf("  if(s.node_begin(\"%s\", hash(\"%s\"), &o)) {" ENDL, sname, sname);
 
-      for (auto & member : structi.members) {
-        if (member.kind != Member_info_kind::Field)
-          continue;
-        const char * mname = member.name;
-        printf_ttws("    s.key(\"%s\");                                               " ENDL, mname);
-        if (member.count > 1 && rose::hash(member.type) == rose::hash("char")) {
-          //when type is char[n] then treat is as a string.
-          int bit = 0;
-          bit |= (member.annotations == member_annotations_t::Data) ? 1 << 0 : 0;
-          bit |= (member.annotations == member_annotations_t::String) ? 1 << 1 : 0;
-          switch (bit)
-          {
-          case 1 << 0: //DATA
-            printf_ttws("    serialize(o.%s, s);                                        " ENDL, mname);
-            break;
-          case 1 << 1: //STRING
-            printf_ttws("    serialize(o.%s, s, std::strlen(o.%s));                     " ENDL, mname, mname);
-            break;
-          case 0: //NONE
-            fprintf(stderr, "Member '%s::%s' must have either annotations @String or @Data.", sname, member.name);
-            exit(1);
-            break;
-          case 1 << 0 | 1 << 1: //BOTH
-            fprintf(stderr, "Member '%s::%s' can't have both annotations @String and @Data.", sname, member.name);
-            exit(1);
-            break;
-          default:
-            //Shoyuld be unreachable
-            assert(false);
-            break;
-          }
-        }
-        else {
-          printf_ttws("    serialize(o.%s, s);                                        " ENDL, mname);
+    for (auto & member : members(c, structi)) {
+      if (member.kind != Member_info_kind::Field)
+        continue;
+      const char * mname = str(c, member.name);
+      emitf("    s.key(\"%s\");" ENDL, mname);
+      if (member.count > 1 && member.type == char_type) {
+        //when type is char[n] then treat is as a string.
+        int bit = 0;
+        bit |= (member.annotations & member_annotations_t::Data) ? 1 << 0 : 0;
+        bit |= (member.annotations & member_annotations_t::String) ? 1 << 1 : 0;
+        switch (bit)
+        {
+        case 1 << 0: //DATA
+          emitf("    serialize(o.%s, s);" ENDL, mname);
+          break;
+        case 1 << 1: //STRING
+          emitf("    serialize(o.%s, s, std::strlen(o.%s));" ENDL, mname, mname);
+          break;
+        case 0: //NONE
+          fprintf(stderr, "Member '%s::%s' must have either annotations @String or @Data.", sname, mname);
+          exit(1);
+          break;
+        case 1 << 0 | 1 << 1: //BOTH
+          fprintf(stderr, "Member '%s::%s' can't have both annotations @String and @Data.", sname, mname);
+          exit(1);
+          break;
+        default:
+          //Shoyuld be unreachable
+          assert(false);
+          break;
         }
       }
-      printf_ttws("    s.node_end();                                                  " ENDL);
-      printf_ttws("  }                                                                " ENDL);
-      printf_ttws("  s.end();                                                         " ENDL);
-      printf_ttws("}                                                                   \n" ENDL);
-    }
-
-    if (!has_deserialize) {
-      ///////////////////////////////////////////////////////////////////
-      // deserializer                                                  //
-      ///////////////////////////////////////////////////////////////////
-      printf_ttws("inline void rose::deserialize(%s &o, IDeserializer &s) {  " ENDL, sname);
-      printf_ttws("  while (s.next_key()) {                                " ENDL);
-      printf_ttws("    switch (s.hash_key()) {                             " ENDL);
-
-      for (auto & member : structi.members) {
-        if (member.kind != Member_info_kind::Field)
-          continue;
-        const char * mname = member.name;
-        printf_ttws("      case rose::hash(\"%s\"):                        " ENDL, mname);
-        printf_ttws("        deserialize(o.%s, s);                         " ENDL, mname);
-        printf_ttws("        break;                                        " ENDL);
+      else {
+        emitf("    serialize(o.%s, s);" ENDL, mname);
       }
-      printf_ttws("      default: s.skip_key(); break;                     " ENDL);
-      printf_ttws("    }                                                   " ENDL);
-      printf_ttws("  }                                                     " ENDL);
-      printf_ttws("}                                                        \n" ENDL);
     }
+    emit("    s.node_end();" ENDL);
+    emit("  }" ENDL);
+    emit("  s.end();" ENDL);
+    emit("}\n" ENDL);
+  }
 
+  if (!has_deserialize) {
     ///////////////////////////////////////////////////////////////////
-    // hashing                                                       //
+    // deserializer                                                  //
     ///////////////////////////////////////////////////////////////////
-    printf_ttws("inline RHash rose::hash(const %s &o) {             " ENDL, sname);
-    printf_ttws("  RHash h = 0; " ENDL);
-    bool first = true;
-    for (std::size_t i = 0; i != structi.members.size(); ++i) {
-      auto & member = structi.members[i];
+    emitf("%svoid rose::deserialize(%s &o, IDeserializer &s) {" ENDL, inl, sname);
+    emit("  while (s.next_key()) {" ENDL);
+    emit("    switch (s.hash_key()) {" ENDL);
+
+    for (auto & member : members(c, structi)) {
       if (member.kind != Member_info_kind::Field)
         continue;
-      if (!first) printf_ttws("  h = rose::xor64(h);                    " ENDL);
-      printf_ttws("  h ^= rose::rose_parser_hash(o.%s);                 " ENDL, member.name);
-      first = false;
+      const char * mname = str(c, member.name);
+      emitf("      case rose::hash(\"%s\"):" ENDL, mname);
+      emitf("        deserialize(o.%s, s);" ENDL, mname);
+      emit("        break;" ENDL);
     }
-    printf_ttws("  return h;                          " ENDL);
-    printf_ttws("}                                    " ENDL);
-    puts("");
+    emit("      default: s.skip_key(); break;" ENDL);
+    emit("    }" ENDL);
+    emit("  }" ENDL);
+    emit("}\n" ENDL);
+  }
 
-    ///////////////////////////////////////////////////////////////////
-    // type info                                                     //
-    ///////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////
+  // hashing                                                       //
+  ///////////////////////////////////////////////////////////////////
+  emitf("%sRHash rose::hash(const %s &o) {" ENDL, inl, sname);
+  emit("  RHash h = 0;" ENDL);
+  bool first = true;
+  auto struct_members = members(c, structi);
+  for (std::size_t i = 0; i != struct_members.size(); ++i) {
+    auto & member = struct_members[i];
+    if (member.kind != Member_info_kind::Field)
+      continue;
+    if (!first) emit("  h = rose::xor64(h);" ENDL);
+    emitf("  h ^= rose::rose_parser_hash(o.%s);" ENDL, str(c, member.name));
+    first = false;
+  }
+  emit("  return h;" ENDL);
+  emit("}" ENDL);
+  emit(ENDL);
+
+  ///////////////////////////////////////////////////////////////////
+  // type info                                                     //
+  ///////////////////////////////////////////////////////////////////
 
-    
-    printf_ttws("template <>                                           " ENDL);
-    printf_ttws("struct rose::type_id<%s> {                            " ENDL, sname);
-    printf_ttws("    inline static RHash VALUE = %lluULL;   " ENDL, (unsigned long long)filtered_struct_hash(structi));    
-    printf_ttws("};                                                    " ENDL);
-    printf_ttws(ENDL);
-
-    printf_ttws("template <>                                                                                                                           " ENDL);
-    printf_ttws("inline const rose::reflection::TypeInfo & rose::reflection::get_type_info<%s>() {                                                     " ENDL, sname);
-    printf_ttws("  static rose::reflection::TypeInfo info = {                                                                                          " ENDL);
-    printf_ttws("    /*             unique_id */ rose::hash(\"%s\"),                                                                                   " ENDL, sname);
-    printf_ttws("    /*           member_hash */ %lluULL,                                                                                              " ENDL, (unsigned long long)filtered_struct_hash(structi));
-    printf_ttws("    /*      memory_footprint */ sizeof(%s),                                                                                           " ENDL, sname);
-    printf_ttws("    /*      memory_alignment */ 16,                                                                                                   " ENDL);
-    printf_ttws("    /*                  name */ \"%s\",                                                                                               " ENDL, sname);
-    printf_ttws("    /*  fp_default_construct */ +[](void * ptr) { new (ptr) %s(); },                                                                  " ENDL, sname);
-    printf_ttws("    /*   fp_default_destruct */ +[](void * ptr) { std::launder(reinterpret_cast<%s*>(ptr))->~%s(); },                                 " ENDL, sname, sname_nons);
-    printf_ttws("    /*          fp_serialize */ +[](void * ptr, ISerializer & s) { ::rose::serialize(*std::launder(reinterpret_cast<%s*>(ptr)), s); },    " ENDL, sname);
-    printf_ttws("    /*        fp_deserialize */ +[](void * ptr, IDeserializer & d) { ::rose::deserialize(*std::launder(reinterpret_cast<%s*>(ptr)), d); } " ENDL, sname);
-    printf_ttws("  };                                                                                                                                           " ENDL);
-    printf_ttws("  return info;                                                                                                                                 " ENDL);
-    printf_ttws("}                                                                                                                                              " ENDL);
-    puts("");
+  
+  if (layout == layout_t::Split) {
+    emitf("RHash rose::type_id<%s>::VALUE = %lluULL;" ENDL, sname, (unsigned long long)structi.fingerprint);
+  }
+  else {
+    emit("template <>" ENDL);
+    emitf("struct rose::type_id<%s> {" ENDL, sname);
+    emitf("    inline static RHash VALUE = %lluULL;" ENDL, (unsigned long long)structi.fingerprint);
+    emit("};" ENDL);
   }
+  emit(ENDL);
+
+  emit("template <>" ENDL);
+  emitf("%sconst rose::reflection::TypeInfo & rose::reflection::get_type_info<%s>() {" ENDL, inl, sname);
+  emit("  static rose::reflection::TypeInfo info = {" ENDL);
+  emitf("    /*             unique_id */ rose::hash(\"%s\")," ENDL, sname);
+  emitf("    /*           member_hash */ %lluULL," ENDL, (unsigned long long)structi.fingerprint);
+  emitf("    /*      memory_footprint */ sizeof(%s)," ENDL, sname);
+  emit("    /*      memory_alignment */ 16," ENDL);
+  emitf("    /*                  name */ \"%s\"," ENDL, sname);
+  emitf("    /*  fp_default_construct */ +[](void * ptr) { new (ptr) %s(); }," ENDL, sname);
+  emitf("    /*   fp_default_destruct */ +[](void * ptr) { std::launder(reinterpret_cast<%s*>(ptr))->~%s(); }," ENDL, sname, sname_nons);
+  emitf("    /*          fp_serialize */ +[](void * ptr, ISerializer & s) { ::rose::serialize(*std::launder(reinterpret_cast<%s*>(ptr)), s); }," ENDL, sname);
+  emitf("    /*        fp_deserialize */ +[](void * ptr, IDeserializer & d) { ::rose::deserialize(*std::launder(reinterpret_cast<%s*>(ptr)), d); }" ENDL, sname);
+  emit("  };" ENDL);
+  emit("  return info;" ENDL);
+  emit("}" ENDL);
+  emit(ENDL);
+}
+
+void emit_predefs(const ir::context & c, const function_index & functions, layout_t layout) {
+  emit_ordered(c.enum_classes.size(), [&](size_t type) {
+    auto & enumci = c.enum_classes[type];
+    if (enumci.emit) emit_enum_predef(c, enumci, layout);
+  });
+
+  emit_ordered(c.structs.size(), [&](size_t type) {
+    auto & structi = c.structs[type];
+    if (structi.emit) emit_struct_predef(c, functions, structi, layout);
+  });
+}
+
+void dump_cpp(const ir::context & c, int argc = 0, char ** argv = nullptr) {
+  emit_prologue(argc, argv);
+
+  function_index functions;
+  build_function_index(functions, c);
+
+  // deump definition
+
+  emit_predefs(c, functions, layout_t::Header);
+
+  // dump implementation
+
+  emit_impl_helpers();
+
+  emit_ordered(c.enum_classes.size(), [&](size_t type) {
+    auto & enumci = c.enum_classes[type];
+    if (enumci.emit) emit_enum_impl(c, enumci, layout_t::Header);
+  });
+
+  string_id char_type = find_string(c.strings, "char");
+
+  emit_ordered(c.structs.size(), [&](size_t type) {
+    auto & structi = c.structs[type];
+    if (structi.emit) emit_struct_impl(c, functions, char_type, structi, layout_t::Header);
+  });
 
   //end
 }
 
+//Writes the predefs to header_path and the impls out of line to impl_path.
+//The .cpp includes the input files and the header, the helpers are only
+//compiled there.
+bool dump_split(const ir::context & c, const std::vector<const char *> & input_files, const char * header_path, const char * impl_path, bool verbose, int argc, char ** argv) {
+  function_index functions;
+  build_function_index(functions, c);
+
+  emit_prologue(argc, argv);
+  emit_predefs(c, functions, layout_t::Split);
+  if (!write_output_file(main_output, header_path, verbose)) {
+    fprintf(stderr, "can't write %s" ENDL, header_path);
+    return false;
+  }
+
+  //relative to the .cpp, like the quoted #includes are resolved
+  std::filesystem::path impl_dir = std::filesystem::absolute(impl_path).parent_path();
+  auto emit_include = [&](const char * path) {
+    std::filesystem::path absolute = std::filesystem::absolute(path);
+    std::filesystem::path relative = absolute.lexically_relative(impl_dir);
+    emitf("#include \"%s\"" ENDL, (relative.empty() ? absolute : relative).generic_string().c_str());
+  };
+  for (const char * path : input_files) emit_include(path);
+  emit_include(header_path);
+  emit(ENDL);
+  emit_command(argc, argv);
+
+  emit_impl_helpers();
+
+  emit_ordered(c.enum_classes.size(), [&](size_t type) {
+    auto & enumci = c.enum_classes[type];
+    if (enumci.emit) emit_enum_impl(c, enumci, layout_t::Split);
+  });
+
+  string_id char_type = find_string(c.strings, "char");
+
+  emit_ordered(c.structs.size(), [&](size_t type) {
+    auto & structi = c.structs[type];
+    if (structi.emit) emit_struct_impl(c, functions, char_type, structi, layout_t::Split);
+  });
+
+  if (!write_output_file(main_output, impl_path, verbose)) {
+    fprintf(stderr, "can't write %s" ENDL, impl_path);
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////
+// SHARDS                                             //
+////////////////////////////////////////////////////////
+
+enum class shard_by_t {
+  NONE = 0,
+  File,
+  Type
+};
+
+constexpr size_t no_shard = ~(size_t)0;
+
+//With --shard-by the impls of one input file or of one type go to a header
+//of their own. The predefs of all types and the helpers are shared in
+//serializer_predef.h: the helpers are templates that only see the predefs in
+//front of them. It only changes if types are added, removed or renamed.
+
+//A generated header with the impls of one input file or of one type. Types
+//are numbered like in type_graph, the enum classes come first.
+struct shard_info {
+  std::string name;
+  std::vector<size_t> types;
+  //shards that define the types used in the fields, included by this one
+  std::vector<size_t> dependencies;
+};
+
+//"foo" -> "foo_serializer.h". Names that only differ in case get a number, so
+//the shards don't overwrite each other on case insensitive file systems.
+std::string shard_name(std::unordered_set<std::string> & used, const std::string & base) {
+  for (size_t n = 1;; ++n) {
+    std::string name = n == 1 ? base : base + "_" + std::to_string(n);
+    std::string key = name;
+    for (char & ch : key) ch = (char)std::tolower((unsigned char)ch);
+    if (used.insert(key).second) return name + "_serializer.h";
+  }
+}
+
+void build_shards(std::vector<shard_info> & shards, const ir::context & c, const type_graph & graph, shard_by_t shard_by) {
+  std::unordered_set<std::string> used;
+  std::vector<size_t> file_shards(c.files.size(), no_shard);
+  if (shard_by == shard_by_t::File) {
+    std::vector<bool> has_types(c.files.size());
+    for (auto & enumci : c.enum_classes) has_types[enumci.file] = has_types[enumci.file] || enumci.emit;
+    for (auto & structi : c.structs) has_types[structi.file] = has_types[structi.file] || structi.emit;
+    for (size_t i = 0; i != c.files.size(); ++i) {
+      if (!has_types[i]) continue;
+      std::string path = str(c, c.files[i]);
+      file_shards[i] = shards.size();
+      shards.emplace_back().name = shard_name(used, path == "-" ? "stdin" : std::filesystem::path(path).stem().string());
+    }
+  }
+
+  //"ns::foo" -> "ns.foo"
+  auto add_type = [&](size_t type, uint32_t file, string_id name) {
+    size_t shard = file_shards[file];
+    if (shard_by == shard_by_t::Type) {
+      std::string base = str(c, name);
+      for (size_t i = base.find("::"); i != std::string::npos; i = base.find("::", i)) base.replace(i, 2, ".");
+      shard = shards.size();
+      shards.emplace_back().name = shard_name(used, base);
+    }
+    shards[shard].types.push_back(type);
+    return shard;
+  };
+
+  std::vector<size_t> enum_shards(c.enum_classes.size(), no_shard);
+  std::vector<size_t> struct_shards(c.structs.size(), no_shard);
+  for (size_t i = 0; i != c.enum_classes.size(); ++i) {
+    auto & enumci = c.enum_classes[i];
+    if (enumci.emit) enum_shards[i] = add_type(~i, enumci.file, enumci.name_withns);
+  }
+  for (size_t i = 0; i != c.structs.size(); ++i) {
+    auto & structi = c.structs[i];
+    if (structi.emit) struct_shards[i] = add_type(i, structi.file, structi.name_withns);
+  }
+
+  for (size_t i = 0; i != c.structs.size(); ++i) {
+    size_t shard = struct_shards[i];
+    if (shard == no_shard) continue;
+    for_each_field_type(c, graph, c.structs[i], [&](size_t type) {
+      size_t dependency = type < c.structs.size() ? struct_shards[type] : enum_shards[~type];
+      if (dependency != no_shard && dependency != shard) shards[shard].dependencies.push_back(dependency);
+    });
+  }
+  for (auto & shard : shards) {
+    std::sort(shard.dependencies.begin(), shard.dependencies.end());
+    shard.dependencies.erase(std::unique(shard.dependencies.begin(), shard.dependencies.end()), shard.dependencies.end());
+  }
+}
+
+void emit_shard(const ir::context & c, const function_index & functions, string_id char_type, const std::vector<shard_info> & shards, const shard_info & shard, int argc, char ** argv) {
+  emit_prologue(argc, argv);
+  emit("#include \"serializer_predef.h\"" ENDL);
+  for (size_t dependency : shard.dependencies) emitf("#include \"%s\"" ENDL, shards[dependency].name.c_str());
+  emit(ENDL);
+
+  for (size_t type : shard.types) {
+    if (type < c.structs.size()) emit_struct_impl(c, functions, char_type, c.structs[type], layout_t::Shards);
+    else emit_enum_impl(c, c.enum_classes[~type], layout_t::Shards);
+  }
+}
+
+//Writes a header per shard, serializer_predef.h and serializer.h, which
+//includes all shards, into dir. Like with -O only files whose content changed
+//are replaced.
+bool dump_shards(const ir::context & c, const type_graph & graph, shard_by_t shard_by, const char * dir, bool verbose, int argc, char ** argv) {
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  if (ec) {
+    fprintf(stderr, "can't create %s" ENDL, dir);
+    return false;
+  }
+
+  std::vector<shard_info> shards;
+  build_shards(shards, c, graph, shard_by);
+
+  function_index functions;
+  build_function_index(functions, c);
+  string_id char_type = find_string(c.strings, "char");
+
+  std::atomic<bool> ok{true};
+  auto write = [&](output_writer & output, const std::string & name) {
+    std::string path = (std::filesystem::path(dir) / name).string();
+    if (write_output_file(output, path.c_str(), verbose)) return;
+    fprintf(stderr, "can't write %s" ENDL, path.c_str());
+    ok = false;
+  };
+
+  task_group group;
+  for (size_t i = 0; i != shards.size(); ++i) {
+    run_task(group, [&, i]() {
+      output_writer output;
+      output_writer * saved = current_output;
+      current_output = &output;
+      emit_shard(c, functions, char_type, shards, shards[i], argc, argv);
+      current_output = saved;
+      write(output, shards[i].name);
+    });
+  }
+  wait_tasks(group);
+
+  emit_prologue(argc, argv);
+  emit_predefs(c, functions, layout_t::Shards);
+  emit_impl_helpers();
+  write(main_output, "serializer_predef.h");
+
+  emit_prologue(argc, argv);
+  for (auto & shard : shards) emitf("#include \"%s\"" ENDL, shard.name.c_str());
+  write(main_output, "serializer.h");
+  return ok;
+}
+
 void printhelp() {
   puts(
     "NAME" ENDL
@@ -970,13 +4084,50 @@ void printhelp() {
     ENDL
     "       -I, --includes" ENDL
     "              followed by a list of headers files, that should be parsed." ENDL
+    "              Use '-' to read a header from stdin. Headers without any struct, enum," ENDL
+    "              annotation or operator are skipped." ENDL
+    ENDL
+    "       -F, --follow" ENDL
+    "              Also parse the headers included with #include \"...\". They are searched" ENDL
+    "              next to the including file first, then in the search paths. Every" ENDL
+    "              header is parsed once, even if it's included several times." ENDL
+    ENDL
+    "       -IDIR, --include-path DIR" ENDL
+    "              Adds DIR to the search paths of --follow." ENDL
+    ENDL
+    "       --roots TYPE[,TYPE...]" ENDL
+    "              Only emit code for these types and the types they use in their fields." ENDL
+    "              Structs and enums annotated with //@Root are roots as well." ENDL
     ENDL
     "       -O, --output" ENDL
     "              The output file. [default: stdout]" ENDL
+    "              The file is only replaced if the generated code changed." ENDL
+    ENDL
+    "       --shard-by file|type" ENDL
+    "              Write a header per input file or per type into the directory given" ENDL
+    "              with -O, instead of one output file. serializer.h in the directory" ENDL
+    "              includes all of them, serializer_predef.h declares all types." ENDL
+    ENDL
+    "       --impl FILE" ENDL
+    "              Write the definitions out of line to FILE, a .cpp that includes the" ENDL
+    "              input headers and the output file. The output file (-O) then only" ENDL
+    "              has declarations and doesn't change if only fields change." ENDL
     ENDL
     "       -J, --json" ENDL
     "              A optional JSON file containing meta info of the header files." ENDL
     ENDL
+    "       -D, --define" ENDL
+    "              Followed by NAME or NAME=VALUE. Used to evaluate #if, #ifdef and #ifndef." ENDL
+    "              Disabled blocks are skipped." ENDL
+    ENDL
+    "       -S, --stream" ENDL
+    "              Read the headers through a fixed size window instead of loading them" ENDL
+    "              as a whole. Keeps memory usage constant for very large inputs." ENDL
+    ENDL
+    "       -j, --jobs" ENDL
+    "              Followed by the number of threads used for parsing and code generation." ENDL
+    "              [default: number of cores]" ENDL
+    ENDL
     "       -V, --verbose" ENDL
     "              Verbose output." ENDL
     ENDL
@@ -996,11 +4147,14 @@ int main(int argc, char ** argv) {
 
   RHash state = rose::hash("NONE");
 
-  char tmp_path[260];
-  char dst_path[260];
-
-  bool write_to_file = false; //in case we redirect stdout to something else
+  const char * output_path = nullptr;
+  const char * impl_path = nullptr;
+  shard_by_t shard_by = shard_by_t::NONE;
   bool verbose = false;
+  bool stream = false;
+  bool follow = false;
+  header_cache headers;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
 
   const char * json_path = nullptr;
 
@@ -1024,6 +4178,66 @@ int main(int argc, char ** argv) {
       state = rose::hash("INCLUDE");
       continue;
     }
+    //-I alone starts the list of input files, -IDIR adds a search path
+    if (h == rose::hash("--include-path")) {
+      ++i;
+      assert(i != argc);
+      headers.search_paths.push_back(argv[i]);
+      continue;
+    }
+    if (arg[0] == '-' && arg[1] == 'I' && arg[2] != 0) {
+      headers.search_paths.push_back(arg + 2);
+      continue;
+    }
+    if (h == rose::hash("--roots")) {
+      ++i;
+      assert(i != argc);
+      for (const char * name = argv[i]; *name;) {
+        const char * end = name;
+        while (*end && *end != ',') ++end;
+        if (end != name) root_names.emplace_back(name, end);
+        name = *end ? end + 1 : end;
+      }
+      continue;
+    }
+    if (h == rose::hash("--shard-by")) {
+      ++i;
+      assert(i != argc);
+      switch (rose::hash(argv[i])) {
+      case rose::hash("file"): shard_by = shard_by_t::File; break;
+      case rose::hash("type"): shard_by = shard_by_t::Type; break;
+      default: printf("Unknown argument %s." ENDL, argv[i]); exit(1); break;
+      }
+      continue;
+    }
+    if (h == rose::hash("--follow") || h == rose::hash("-F")) {
+      follow = true;
+      continue;
+    }
+    if (h == rose::hash("--define") || h == rose::hash("-D")) {
+      ++i;
+      assert(i != argc);
+      add_define(command_line_defines, argv[i]);
+      continue;
+    }
+    if (arg[0] == '-' && arg[1] == 'D' && arg[2] != 0) {
+      add_define(command_line_defines, arg + 2);
+      continue;
+    }
+    if (h == rose::hash("--stream") || h == rose::hash("-S")) {
+      stream = true;
+      continue;
+    }
+    if (h == rose::hash("--jobs") || h == rose::hash("-j")) {
+      ++i;
+      assert(i != argc);
+      jobs = std::max(1, atoi(argv[i]));
+      continue;
+    }
+    if (arg[0] == '-' && arg[1] == 'j' && arg[2] >= '0' && arg[2] <= '9') {
+      jobs = std::max(1, atoi(arg + 2));
+      continue;
+    }
     if (h == rose::hash("--verbose") || h == rose::hash("-V")) {
       verbose = true;
       continue;
@@ -1032,10 +4246,14 @@ int main(int argc, char ** argv) {
       state = rose::hash("NONE");
       ++i;
       assert(i != argc);
-      sprintf(dst_path, "%s", argv[i]);
-      sprintf(tmp_path, "%s.bak", argv[i]);
-      (void)freopen(tmp_path, "wb", stdout);
-      write_to_file = true;
+      output_path = argv[i];
+      continue;
+    }
+    if (h == rose::hash("--impl")) {
+      state = rose::hash("NONE");
+      ++i;
+      assert(i != argc);
+      impl_path = argv[i];
       continue;
     }
     if (h == rose::hash("--json") || h == rose::hash("-J")) {
@@ -1057,29 +4275,70 @@ int main(int argc, char ** argv) {
     }
   }
 
-  ParseContext c;
+  if (shard_by != shard_by_t::NONE && !output_path) {
+    fprintf(stderr, "--shard-by needs the output directory (-O DIR)" ENDL);
+    exit(1);
+  }
+  if (impl_path) {
+    if (!output_path || shard_by != shard_by_t::NONE) {
+      fprintf(stderr, "--impl needs the output header (-O FILE) and can't be used with --shard-by" ENDL);
+      exit(1);
+    }
+    for (const char * path : input_files) {
+      if (!is_equal(path, "-")) continue;
+      fprintf(stderr, "--impl can't include a header read from stdin" ENDL);
+      exit(1);
+    }
+  }
+
+  start_workers(jobs);
 
-  for (auto path : input_files) {
-    rose::StreamBuffer buffer;
-    if (verbose) fprintf(stderr, "Parsing File %s" ENDL, path);
-    buffer.load(path);
-    parse(c, buffer);
-    buffer.unload();
+  //every file is parsed into its own context, they are merged in the order
+  //of the command line
+  ir::context c;
+  if (follow) {
+    parse_headers(c, headers, input_files, stream, verbose);
+  }
+  else {
+    std::vector<ir::context> results(input_files.size());
+    task_group files;
+    for (size_t i = 0; i != input_files.size(); ++i) {
+      const char * path = input_files[i];
+      if (verbose) fprintf(stderr, "Parsing File %s" ENDL, path);
+      run_task(files, [&, i, path]() { parse_file(results[i], path, stream, verbose); });
+    }
+    wait_tasks(files);
+    for (auto & result : results) append(c, result);
   }
 
-  dump_cpp(c, argc, argv);
+  type_graph graph;
+  build_type_graph(graph, c);
+  fingerprint_types(c, graph);
+  prune_types(c, graph);
 
-  if (write_to_file) {
-    fclose(stdout);
-    auto ok = MoveFileExA(tmp_path, dst_path, MOVEFILE_REPLACE_EXISTING);
-    rose::unused(ok);
+  if (shard_by != shard_by_t::NONE) {
+    if (!dump_shards(c, graph, shard_by, output_path, verbose, argc, argv)) return 1;
+  }
+  else if (impl_path) {
+    if (!dump_split(c, input_files, output_path, impl_path, verbose, argc, argv)) return 1;
+  }
+  else {
+    dump_cpp(c, argc, argv);
+    if (!output_path) {
+      write_output(main_output, stdout);
+    } else if (!write_output_file(main_output, output_path, verbose)) {
+      fprintf(stderr, "can't write %s" ENDL, output_path);
+      return 1;
+    }
   }
 
   if (json_path) {
     FILE * f = fopen(json_path, "w");
     assert(f);
+    ParseContext exported;
+    export_context(c, exported);
     JsonSerializer jsons(f);
-    rose::serialize(c, jsons);
+    rose::serialize(exported, jsons);
     fclose(f);
   }
 
@@ -262,13 +262,13 @@ RHash rose_parser_hash(const std::vector<T>& v) {
 //  impl enum member_annotations_t
 ///////////////////////////////////////////////////////////////////
 inline const char * rose::to_string(const member_annotations_t & e) {
-    switch(e) {
-        case member_annotations_t::NONE: return "NONE";
-        case member_annotations_t::Ignore: return "Ignore";
-        case member_annotations_t::String: return "String";
-        case member_annotations_t::Data: return "Data";
-        default: return "<UNKNOWN>";
-    }
+  switch (e) {
+    case member_annotations_t::NONE: return "NONE";
+    case member_annotations_t::Ignore: return "Ignore";
+    case member_annotations_t::String: return "String";
+    case member_annotations_t::Data: return "Data";
+    default: return "<UNKNOWN>";
+  }
 }
 inline void rose::serialize(member_annotations_t& o, ISerializer& s) {
   switch (o) {
@@ -300,11 +300,11 @@ inline void rose::deserialize(member_annotations_t& o, IDeserializer& s) {
   deserialize(str, s);
   RHash h = rose::hash(str);
   switch (h) {
-  case rose::hash("NONE"): o = member_annotations_t::NONE; break;
-  case rose::hash("Ignore"): o = member_annotations_t::Ignore; break;
-  case rose::hash("String"): o = member_annotations_t::String; break;
-  case rose::hash("Data"): o = member_annotations_t::Data; break;
-  default: /*unknown value*/ break;
+    case rose::hash("NONE"): o = member_annotations_t::NONE; break;
+    case rose::hash("Ignore"): o = member_annotations_t::Ignore; break;
+    case rose::hash("String"): o = member_annotations_t::String; break;
+    case rose::hash("Data"): o = member_annotations_t::Data; break;
+    default: /*unknown value*/ break;
   }
 }
 inline RHash rose::hash(const member_annotations_t& o) {
@@ -315,11 +315,12 @@ inline RHash rose::hash(const member_annotations_t& o) {
 //  impl enum value_type_t
 ///////////////////////////////////////////////////////////////////
 inline const char * rose::to_string(const value_type_t & e) {
-    switch(e) {
-        case value_type_t::Increment: return "Increment";
-        case value_type_t::Set: return "Set";
-        default: return "<UNKNOWN>";
-    }
+  static const char * const names[] = {
+    "Increment",
+    "Set",
+  };
+  long long i = static_cast<long long>(e) - (0LL);
+  return i >= 0 && i < 2 ? names[i] : "<UNKNOWN>";
 }
 inline void rose::serialize(value_type_t& o, ISerializer& s) {
   switch (o) {
@@ -341,9 +342,9 @@ inline void rose::deserialize(value_type_t& o, IDeserializer& s) {
   deserialize(str, s);
   RHash h = rose::hash(str);
   switch (h) {
-  case rose::hash("Increment"): o = value_type_t::Increment; break;
-  case rose::hash("Set"): o = value_type_t::Set; break;
-  default: /*unknown value*/ break;
+    case rose::hash("Increment"): o = value_type_t::Increment; break;
+    case rose::hash("Set"): o = value_type_t::Set; break;
+    default: /*unknown value*/ break;
   }
 }
 inline RHash rose::hash(const value_type_t& o) {
@@ -354,12 +355,13 @@ inline RHash rose::hash(const value_type_t& o) {
 //  impl enum global_annotations_t
 ///////////////////////////////////////////////////////////////////
 inline const char * rose::to_string(const global_annotations_t & e) {
-    switch(e) {
-        case global_annotations_t::NONE: return "NONE";
-        case global_annotations_t::Flag: return "Flag";
-        case global_annotations_t::Imposter: return "Imposter";
-        default: return "<UNKNOWN>";
-    }
+  static const char * const names[] = {
+    "NONE",
+    "Flag",
+    "Imposter",
+  };
+  long long i = static_cast<long long>(e) - (0LL);
+  return i >= 0 && i < 3 ? names[i] : "<UNKNOWN>";
 }
 inline void rose::serialize(global_annotations_t& o, ISerializer& s) {
   switch (o) {
@@ -386,10 +388,10 @@ inline void rose::deserialize(global_annotations_t& o, IDeserializer& s) {
   deserialize(str, s);
   RHash h = rose::hash(str);
   switch (h) {
-  case rose::hash("NONE"): o = global_annotations_t::NONE; break;
-  case rose::hash("Flag"): o = global_annotations_t::Flag; break;
-  case rose::hash("Imposter"): o = global_annotations_t::Imposter; break;
-  default: /*unknown value*/ break;
+    case rose::hash("NONE"): o = global_annotations_t::NONE; break;
+    case rose::hash("Flag"): o = global_annotations_t::Flag; break;
+    case rose::hash("Imposter"): o = global_annotations_t::Imposter; break;
+    default: /*unknown value*/ break;
   }
 }
 inline RHash rose::hash(const global_annotations_t& o) {
@@ -400,14 +402,15 @@ inline RHash rose::hash(const global_annotations_t& o) {
 //  impl enum Member_info_kind
 ///////////////////////////////////////////////////////////////////
 inline const char * rose::to_string(const Member_info_kind & e) {
-    switch(e) {
-        case Member_info_kind::NONE: return "NONE";
-        case Member_info_kind::Field: return "Field";
-        case Member_info_kind::Function: return "Function";
-        case Member_info_kind::Constructor: return "Constructor";
-        case Member_info_kind::Destructor: return "Destructor";
-        default: return "<UNKNOWN>";
-    }
+  static const char * const names[] = {
+    "NONE",
+    "Field",
+    "Function",
+    "Constructor",
+    "Destructor",
+  };
+  long long i = static_cast<long long>(e) - (0LL);
+  return i >= 0 && i < 5 ? names[i] : "<UNKNOWN>";
 }
 inline void rose::serialize(Member_info_kind& o, ISerializer& s) {
   switch (o) {
@@ -444,12 +447,12 @@ inline void rose::deserialize(Member_info_kind& o, IDeserializer& s) {
   deserialize(str, s);
   RHash h = rose::hash(str);
   switch (h) {
-  case rose::hash("NONE"): o = Member_info_kind::NONE; break;
-  case rose::hash("Field"): o = Member_info_kind::Field; break;
-  case rose::hash("Function"): o = Member_info_kind::Function; break;
-  case rose::hash("Constructor"): o = Member_info_kind::Constructor; break;
-  case rose::hash("Destructor"): o = Member_info_kind::Destructor; break;
-  default: /*unknown value*/ break;
+    case rose::hash("NONE"): o = Member_info_kind::NONE; break;
+    case rose::hash("Field"): o = Member_info_kind::Field; break;
+    case rose::hash("Function"): o = Member_info_kind::Function; break;
+    case rose::hash("Constructor"): o = Member_info_kind::Constructor; break;
+    case rose::hash("Destructor"): o = Member_info_kind::Destructor; break;
+    default: /*unknown value*/ break;
   }
 }
 inline RHash rose::hash(const Member_info_kind& o) {
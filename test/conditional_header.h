@@ -0,0 +1,50 @@
+//The structs that are generated depend on the defines given with -D, see the
+//conditional steps in .github/workflows/windows.yml
+#include <cstdio>
+
+#define TEST_VERSION 3
+
+#ifdef TEST_FEATURE
+struct feature_on {
+	int value;
+};
+#else
+struct feature_off {
+	int value;
+};
+#endif
+
+#if TEST_LEVEL == 1
+struct level_one {
+	int value;
+};
+#elif TEST_LEVEL == 2
+#if TEST_VERSION >= 3 && defined(TEST_FEATURE)
+struct feature_level_two {
+	int value;
+};
+#else
+struct level_two {
+	int value;
+};
+#endif
+#else
+struct level_other {
+	int value;
+};
+#endif
+
+#ifndef TEST_FEATURE
+struct feature_missing {
+	int value;
+};
+#endif
+
+#if 0
+//#endif
+/* #else */
+const char * text = "#endif";
+struct disabled {
+	int value;
+};
+#endif
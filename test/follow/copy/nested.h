@@ -0,0 +1,5 @@
+#pragma once
+
+struct follow_copy_nested {
+	int value;
+};
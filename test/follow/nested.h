@@ -0,0 +1,5 @@
+#pragma once
+
+struct follow_nested {
+	int value;
+};
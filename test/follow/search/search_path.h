@@ -0,0 +1,6 @@
+//Only found through --include-path
+#pragma once
+
+struct follow_search_path {
+	int value;
+};
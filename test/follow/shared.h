@@ -0,0 +1,8 @@
+//There is a copy of this file in another directory. It's parsed once, but
+//nested.h is searched next to each copy.
+#pragma once
+#include "nested.h"
+
+struct follow_shared {
+	int value;
+};
@@ -0,0 +1,9 @@
+//Parsed with --follow, see the follow step in .github/workflows/windows.yml
+#include <cstdio>
+#include "follow/shared.h"
+#include "follow/copy/shared.h"
+#include "search_path.h"
+
+struct follow_root {
+	int value;
+};
@@ -0,0 +1,16 @@
+//Generated with --impl, see the impl step in .github/workflows/windows.yml.
+//impl_header.h and impl_header_changed.h only differ in a field, so the
+//generated header must be the same for both.
+#pragma once
+
+enum class impl_mode {
+	OFF,
+	ON,
+};
+
+struct impl_settings {
+	impl_mode mode;
+	int width;
+	int height;
+	float scale;
+};
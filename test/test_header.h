@@ -20,6 +20,29 @@ enum struct enum_test2 {
 	INVALID
 };
 
+//@Flag
+enum class flag_test : unsigned {
+	NONE = 0,
+	A = 1 << 0,
+	B = 1 << 1,
+	C = 1 << 2,
+	AB = A | B
+};
+
+//sparse values, DEFAULT is an alias of MID
+enum class sparse_test {
+	LOW = -8,
+	MID = 100,
+	HIGH = 0x1000,
+	DEFAULT = MID
+};
+
+enum class dense_test : short {
+	MINUS_ONE = -1,
+	ZERO,
+	ONE
+};
+
 /* Multi 
 line comments
 should work fine*/
@@ -38,6 +61,7 @@ void serialize(vector3 & o, ISerializer & s);
 */
 
 struct Camera {
+	static const int version = 1;
 	int x;
 	int y;
 	int z;